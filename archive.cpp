@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+#include "mpbinpack.h"
+
+bool ReadWholeFile(const std::string &path, std::vector<uint8_t> &data)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    data.resize(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    bool success = fread(data.data(), 1, data.size(), file) == data.size();
+    fclose(file);
+    return success;
+}
+
+bool InputFile::Open(const std::string &path)
+{
+    view = NULL;
+    span.size = 0;
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    mapping = NULL;
+    if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+        span.size = (uint32_t)size.QuadPart;
+    }
+#else
+    struct stat info;
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+        view = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED) {
+            view = NULL;
+        }
+        span.size = (uint32_t)info.st_size;
+    }
+#endif
+    if (view) {
+        span.data = (const uint8_t *)view;
+        return true;
+    }
+    Close();
+    if (!ReadWholeFile(path, buf)) {
+        return false;
+    }
+    span.data = buf.data();
+    span.size = buf.size();
+    return true;
+}
+
+void InputFile::Prefetch()
+{
+    if (!view) {
+        return;
+    }
+#ifndef _WIN32
+    madvise(view, span.size, MADV_WILLNEED);
+#endif
+    const volatile uint8_t *data = span.data;
+    for (uint32_t i = 0; i < span.size; i += 4096) {
+        data[i];
+    }
+}
+
+void InputFile::Close()
+{
+#ifdef _WIN32
+    if (view) {
+        UnmapViewOfFile(view);
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (view) {
+        munmap(view, span.size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    fd = -1;
+#endif
+    view = NULL;
+    std::vector<uint8_t>().swap(buf);
+    span.data = NULL;
+    span.size = 0;
+}
+
+bool GetFileInfo(const std::string &path, uint32_t *size, uint64_t *mtime)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+        return false;
+    }
+    *size = data.nFileSizeLow;
+    *mtime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    *size = (uint32_t)info.st_size;
+#ifdef __APPLE__
+    *mtime = ((uint64_t)info.st_mtimespec.tv_sec * 1000000000) + info.st_mtimespec.tv_nsec;
+#else
+    *mtime = ((uint64_t)info.st_mtim.tv_sec * 1000000000) + info.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+bool GetFileSize(const std::string &path, uint32_t *size)
+{
+    uint64_t mtime;
+    return GetFileInfo(path, size, &mtime);
+}
+
+bool GetModifyTime(const std::string &path, uint64_t *mtime)
+{
+    uint32_t size;
+    return GetFileInfo(path, &size, mtime);
+}
+
+void MakeDirectory(const std::string &path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0777);
+#endif
+}
+
+bool RenameFile(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+std::string GetTempPath(const std::string &path)
+{
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = getpid();
+#endif
+    return path + "." + std::to_string(pid) + "_"
+        + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+}
+
+bool ListDirectory(const std::string &dir, std::vector<std::string> &names)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &find_data);
+    if (find == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    do {
+        if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            names.push_back(find_data.cFileName);
+        }
+    } while (FindNextFileA(find, &find_data));
+    FindClose(find);
+#else
+    DIR *handle = opendir(dir.c_str());
+    struct dirent *ent;
+    if (!handle) {
+        return false;
+    }
+    while ((ent = readdir(handle)) != NULL) {
+        struct stat st;
+        if (stat((dir + "/" + ent->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            names.push_back(ent->d_name);
+        }
+    }
+    closedir(handle);
+#endif
+    std::sort(names.begin(), names.end());
+    return true;
+}
+
+// How often modify times are checked where there is no inotify
+#define WATCH_POLL_MS 250
+
+bool FileWatcher::Open(const std::vector<std::string> &watch_paths)
+{
+    paths = watch_paths;
+    mtimes.assign(paths.size(), 0);
+    for (size_t i = 0; i < paths.size(); i++) {
+        GetModifyTime(paths[i], &mtimes[i]);
+    }
+#ifdef __linux__
+    // watching the directories also catches files saved by writing a new
+    // file and renaming it over the old one
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    path_watches.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        size_t name_ofs = paths[i].find_last_of('/');
+        std::string dir = name_ofs != std::string::npos ? paths[i].substr(0, name_ofs + 1) : ".";
+        path_watches[i] = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_DELETE);
+        if (path_watches[i] < 0) {
+            close(fd);
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+bool FileWatcher::Check(uint32_t index, std::vector<uint32_t> &changed)
+{
+    uint64_t mtime = 0;
+    GetModifyTime(paths[index], &mtime);
+    if (mtime == mtimes[index]) {
+        return false;
+    }
+    mtimes[index] = mtime;
+    if (std::find(changed.begin(), changed.end(), index) == changed.end()) {
+        changed.push_back(index);
+    }
+    return true;
+}
+
+bool FileWatcher::Wait(uint32_t timeout_ms, std::vector<uint32_t> &changed)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool found = false;
+    while (!found) {
+        uint64_t waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        if (timeout_ms != 0xFFFFFFFF && waited >= timeout_ms) {
+            break;
+        }
+        uint32_t wait_ms = timeout_ms == 0xFFFFFFFF ? 0xFFFFFFFF : timeout_ms - (uint32_t)waited;
+#ifdef __linux__
+        struct pollfd poll_fd = { fd, POLLIN, 0 };
+        if (poll(&poll_fd, 1, wait_ms == 0xFFFFFFFF ? -1 : (int)wait_ms) <= 0) {
+            continue;
+        }
+        alignas(struct inotify_event) char buf[4096];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            char *ptr = buf;
+            while (ptr < buf + len) {
+                const struct inotify_event *event = (const struct inotify_event *)ptr;
+                ptr += sizeof(struct inotify_event) + event->len;
+                for (uint32_t i = 0; i < paths.size(); i++) {
+                    // events were dropped, so anything may have changed
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        found |= Check(i, changed);
+                    } else if (path_watches[i] == event->wd && event->len != 0
+                        && paths[i].substr(paths[i].find_last_of('/') + 1) == event->name) {
+                        found |= Check(i, changed);
+                    }
+                }
+            }
+        }
+#else
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::min<uint32_t>(wait_ms, WATCH_POLL_MS)));
+        for (uint32_t i = 0; i < paths.size(); i++) {
+            found |= Check(i, changed);
+        }
+#endif
+    }
+    return found;
+}
+
+void FileWatcher::Close()
+{
+#ifdef __linux__
+    close(fd);
+#endif
+}
+
+#define ARCHIVE_BUF_SIZE 0x400000
+
+bool GetAlignedOffset(uint32_t ofs, uint32_t align, uint32_t payload_align, uint32_t *aligned_ofs)
+{
+    align = std::max<uint32_t>(align, 1);
+    payload_align = std::max<uint32_t>(payload_align, 1);
+    uint64_t header_ofs = (((uint64_t)ofs + align - 1) / align) * align;
+    // the payload offset mod payload_align repeats within payload_align steps
+    for (uint32_t i = 0; i < payload_align; i++) {
+        if ((header_ofs + 8) % payload_align == 0) {
+            if (header_ofs > 0xFFFFFFFF) {
+                return false;
+            }
+            *aligned_ofs = header_ofs;
+            return true;
+        }
+        header_ofs += align;
+    }
+    return false;
+}
+
+bool ArchiveWriter::Open(const std::string &out_path, uint32_t file_count)
+{
+    path = out_path;
+    temp_path = GetTempPath(out_path);
+    file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    failed = false;
+    buf.reserve(ARCHIVE_BUF_SIZE);
+    buf.assign((file_count + 1) * 4, 0);
+    ofs = buf.size();
+    return true;
+}
+
+uint32_t ArchiveWriter::WriteEntry(uint32_t raw_size, uint32_t comp_type, const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> header;
+    uint32_t entry_ofs = ofs;
+    WriteU32(header, raw_size);
+    WriteU32(header, comp_type);
+    Write(header.data(), header.size());
+    Write(data.data(), data.size());
+    return entry_ofs;
+}
+
+void ArchiveWriter::Write(const uint8_t *data, size_t len)
+{
+    if (buf.size() + len > ARCHIVE_BUF_SIZE) {
+        Flush();
+    }
+    if (len >= ARCHIVE_BUF_SIZE) {
+        failed |= fwrite(data, 1, len, file) != len;
+    } else {
+        WriteBytes(buf, data, len);
+    }
+    ofs += len;
+}
+
+void ArchiveWriter::Patch(uint32_t patch_ofs, const uint8_t *data, size_t len)
+{
+    uint32_t buf_ofs = ofs - buf.size();
+    if (patch_ofs >= buf_ofs) {
+        memcpy(&buf[patch_ofs - buf_ofs], data, len);
+        return;
+    }
+    Flush();
+    failed |= fseek(file, patch_ofs, SEEK_SET) != 0;
+    failed |= fwrite(data, 1, len, file) != len;
+    failed |= fseek(file, 0, SEEK_END) != 0;
+}
+
+bool ArchiveWriter::Align(uint32_t align, uint32_t payload_align)
+{
+    static const uint8_t zeros[256] = {};
+    uint32_t aligned_ofs;
+    if (!GetAlignedOffset(ofs, align, payload_align, &aligned_ofs)) {
+        return false;
+    }
+    while (ofs < aligned_ofs) {
+        Write(zeros, std::min<uint32_t>(aligned_ofs - ofs, sizeof(zeros)));
+    }
+    return true;
+}
+
+void ArchiveWriter::Flush()
+{
+    failed |= fwrite(buf.data(), 1, buf.size(), file) != buf.size();
+    buf.clear();
+}
+
+bool ArchiveWriter::Close(const uint32_t *ofs_table, uint32_t file_count)
+{
+    Flush();
+    WriteU32(buf, file_count);
+    for (uint32_t i = 0; i < file_count; i++) {
+        WriteU32(buf, ofs_table[i]);
+    }
+    failed |= fseek(file, 0, SEEK_SET) != 0;
+    Flush();
+    failed |= fclose(file) != 0;
+    if (failed || !RenameFile(temp_path, path)) {
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool DecodeEntry(const std::vector<uint8_t> &archive, uint32_t ofs, std::vector<uint8_t> &out, uint32_t *comp_type)
+{
+    if (ofs > archive.size() || archive.size() - ofs < 8) {
+        return false;
+    }
+    uint32_t raw_size = ReadU32(&archive[ofs]);
+    const uint8_t *src = &archive[ofs + 8];
+    uint32_t src_size = archive.size() - ofs - 8;
+    *comp_type = ReadU32(&archive[ofs + 4]);
+    out.resize(raw_size);
+    return DecompressBuffer(src, src_size, *comp_type, out.data(), raw_size);
+}
+
+uint32_t ArchiveBuilder::Add(ByteSpan src, uint32_t comp_type)
+{
+    std::vector<uint8_t> data;
+    if (comp_type == COMP_TYPE_AUTO) {
+        CompressAuto(src, data, &comp_type, options);
+    } else {
+        CompressBuffer(src, comp_type, data, options);
+    }
+    ByteSpan span = { data.data(), (uint32_t)data.size() };
+    return AddCompressed(src.size, comp_type, span);
+}
+
+uint32_t ArchiveBuilder::AddCompressed(uint32_t raw_size, uint32_t comp_type, ByteSpan data)
+{
+    ofs_table.push_back(payload.size());
+    WriteU32(payload, raw_size);
+    WriteU32(payload, comp_type);
+    WriteBytes(payload, data.data, data.size);
+    return ofs_table.size() - 1;
+}
+
+uint32_t ArchiveBuilder::AddDuplicate(uint32_t index)
+{
+    ofs_table.push_back(ofs_table[index]);
+    return ofs_table.size() - 1;
+}
+
+void ArchiveBuilder::Finish(std::vector<uint8_t> &archive)
+{
+    uint32_t header_size = (ofs_table.size() + 1) * 4;
+    archive.clear();
+    archive.reserve(header_size + payload.size());
+    WriteU32(archive, ofs_table.size());
+    for (size_t i = 0; i < ofs_table.size(); i++) {
+        WriteU32(archive, header_size + ofs_table[i]);
+    }
+    WriteBytes(archive, payload.data(), payload.size());
+}
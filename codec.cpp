@@ -0,0 +1,2358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+#include <atomic>
+#include <math.h>
+#include "mpbinpack.h"
+#include "external/zlib/zlib.h"
+
+void WriteU8(std::vector<uint8_t> &buf, uint8_t value)
+{
+    buf.push_back(value);
+}
+
+void WriteU32(std::vector<uint8_t> &buf, uint32_t value)
+{
+    buf.push_back(value >> 24);
+    buf.push_back((value >> 16) & 0xFF);
+    buf.push_back((value >> 8) & 0xFF);
+    buf.push_back(value & 0xFF);
+}
+
+void WriteBytes(std::vector<uint8_t> &buf, const uint8_t *data, size_t len)
+{
+    buf.insert(buf.end(), data, data + len);
+}
+
+void PatchU32(std::vector<uint8_t> &buf, size_t ofs, uint32_t value)
+{
+    buf[ofs] = value >> 24;
+    buf[ofs + 1] = (value >> 16) & 0xFF;
+    buf[ofs + 2] = (value >> 8) & 0xFF;
+    buf[ofs + 3] = value & 0xFF;
+}
+
+void WriteU32(const StreamSink &sink, uint32_t value)
+{
+    uint8_t buf[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+    sink.write(buf, sizeof(buf));
+}
+
+StreamSink MakeVectorSink(std::vector<uint8_t> &buf)
+{
+    StreamSink sink;
+    size_t start = buf.size();
+    sink.write = [&buf](const uint8_t *data, size_t len) {
+        buf.insert(buf.end(), data, data + len);
+    };
+    sink.patch = [&buf, start](uint32_t ofs, const uint8_t *data, size_t len) {
+        memcpy(&buf[start + ofs], data, len);
+    };
+    return sink;
+}
+
+StreamReader MakeFileReader(FILE *file)
+{
+    return [file](uint8_t *buf, size_t len) {
+        return fread(buf, 1, len, file);
+    };
+}
+
+uint32_t ReadU32(const uint8_t *data)
+{
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+#define SLIDE_WINDOW 0x1000
+#define SLIDE_MAX_LEN 0x111
+#define MATCH_HASH_BITS 15
+#define MATCH_MAX_WINDOW 0x1000
+
+// Hash chain over 3-byte prefixes. Find() must be called with non-decreasing
+// positions; everything before the queried position is inserted lazily.
+// Candidates are limited to window bytes back, and to max_len bytes long in
+// MATCH_FAST mode.
+struct HashMatcher
+{
+    const uint8_t *src; // holds the input from position base on
+    uint32_t base;
+    uint32_t size;
+    uint32_t window;
+    uint32_t max_len;
+    MatchMode mode;
+    uint32_t insert_pos;
+    int32_t head[1 << MATCH_HASH_BITS];
+    int32_t prev[MATCH_MAX_WINDOW];
+    // MATCH_COMPAT needs untruncated match lengths. The length found for a
+    // distance at one position stays valid, minus the distance travelled,
+    // until that match runs out, which keeps long runs from being rescanned.
+    uint32_t cache_pos[MATCH_MAX_WINDOW + 1];
+    uint32_t cache_len[MATCH_MAX_WINDOW + 1];
+
+    void Init(const uint8_t *data, uint32_t len, uint32_t window_size, uint32_t match_max, MatchMode match_mode,
+        uint32_t start_pos = 0);
+    void Rebase(const uint8_t *data, uint32_t data_base);
+    uint32_t Hash(uint32_t pos);
+    uint32_t MatchLength(uint32_t pos, uint32_t dist);
+    uint32_t Find(uint32_t pos, uint32_t *pMatchPos);
+};
+
+// Starting at start_pos only inserts the window before it, which gives the
+// same matches from there on as starting at 0.
+void HashMatcher::Init(const uint8_t *data, uint32_t len, uint32_t window_size, uint32_t match_max, MatchMode match_mode,
+    uint32_t start_pos)
+{
+    src = data;
+    base = 0;
+    size = len;
+    window = window_size;
+    max_len = match_max;
+    mode = match_mode;
+    insert_pos = start_pos > window_size ? start_pos - window_size : 0;
+    for (uint32_t i = 0; i < (1 << MATCH_HASH_BITS); i++) {
+        head[i] = -1;
+    }
+    for (uint32_t i = 0; i <= MATCH_MAX_WINDOW; i++) {
+        cache_pos[i] = 0;
+        cache_len[i] = 0;
+    }
+}
+
+// For input streamed through a window: data now holds the input from
+// position data_base on, which must cover the window behind the next
+// position searched.
+void HashMatcher::Rebase(const uint8_t *data, uint32_t data_base)
+{
+    src = data;
+    base = data_base;
+}
+
+uint32_t HashMatcher::Hash(uint32_t pos)
+{
+    const uint8_t *key = &src[pos - base];
+    uint32_t value = (key[0] << 16) | (key[1] << 8) | key[2];
+    return (value * 2654435761U) >> (32 - MATCH_HASH_BITS);
+}
+
+uint32_t HashMatcher::MatchLength(uint32_t pos, uint32_t dist)
+{
+    uint32_t len = 0;
+    if (cache_len[dist] != 0 && pos - cache_pos[dist] < cache_len[dist]) {
+        return cache_len[dist] - (pos - cache_pos[dist]);
+    }
+    len = MatchPrefix(&src[pos - dist - base], &src[pos - base], size - pos);
+    cache_pos[dist] = pos;
+    cache_len[dist] = len;
+    return len;
+}
+
+// Returns the match length at pos, or 1 if there is no match of 3 or more
+// bytes. In MATCH_COMPAT mode this is exactly what the old brute force
+// slide search returned: the untruncated longest match, earliest position
+// first.
+uint32_t HashMatcher::Find(uint32_t pos, uint32_t *pMatchPos)
+{
+    uint32_t len_left = size - pos;
+    uint32_t best_len = 2;
+    uint32_t limit = 0;
+    int32_t cand;
+
+    while (insert_pos < pos && insert_pos + 3 <= size) {
+        uint32_t hash = Hash(insert_pos);
+        prev[insert_pos & (MATCH_MAX_WINDOW - 1)] = head[hash];
+        head[hash] = insert_pos++;
+    }
+    if (len_left < 3) {
+        return 1;
+    }
+    if (pos > window) {
+        limit = pos - window;
+    }
+    if (mode == MATCH_FAST && len_left > max_len) {
+        len_left = max_len;
+    }
+    for (cand = head[Hash(pos)]; cand >= (int32_t)limit; cand = prev[cand & (MATCH_MAX_WINDOW - 1)]) {
+        uint32_t len;
+        if (mode == MATCH_FAST) {
+            const uint8_t *cand_data = &src[cand - base];
+            const uint8_t *pos_data = &src[pos - base];
+            if (cand_data[best_len] != pos_data[best_len]) {
+                continue;
+            }
+            len = MatchPrefix(cand_data, pos_data, len_left);
+            if (len > best_len) {
+                best_len = len;
+                *pMatchPos = cand;
+                if (len == len_left) {
+                    break;
+                }
+            }
+        } else {
+            len = MatchLength(pos, pos - cand);
+            if (len >= best_len && len >= 3) {
+                best_len = len;
+                *pMatchPos = cand;
+            }
+        }
+    }
+    if (best_len < 3) {
+        return 1;
+    }
+    return best_len;
+}
+
+// Entries smaller than this are not worth starting threads for
+#define MATCH_SPLIT_MIN 0x40000
+// Positions each thread searches per batch
+#define MATCH_BATCH_SIZE 0x40000
+
+// HashMatcher::Find results for a batch of positions ahead of the encoder,
+// searched on several threads. Each thread covers its own range with a
+// HashMatcher started at that range, so every position gets exactly the
+// match a single matcher walking the whole input would return.
+struct MatchFinder
+{
+    const uint8_t *src;
+    uint32_t size;
+    uint32_t window;
+    uint32_t max_len;
+    MatchMode mode;
+    std::vector<HashMatcher> matchers;
+    uint32_t table_start;
+    uint32_t table_end;
+    std::vector<uint32_t> table_len;
+    std::vector<uint32_t> table_pos;
+
+    void Init(const uint8_t *data, uint32_t len, uint32_t window_size, uint32_t match_max, MatchMode match_mode,
+        uint32_t thread_count);
+    void Fill(uint32_t pos);
+    void Rebase(const uint8_t *data, uint32_t data_base);
+    uint32_t Find(uint32_t pos, uint32_t *pMatchPos);
+};
+
+void MatchFinder::Init(const uint8_t *data, uint32_t len, uint32_t window_size, uint32_t match_max, MatchMode match_mode,
+    uint32_t thread_count)
+{
+    src = data;
+    size = len;
+    window = window_size;
+    max_len = match_max;
+    mode = match_mode;
+    table_start = table_end = 0;
+    if (thread_count > 1 && len >= MATCH_SPLIT_MIN) {
+        matchers.resize(thread_count);
+        table_len.resize(thread_count * MATCH_BATCH_SIZE);
+        table_pos.resize(thread_count * MATCH_BATCH_SIZE);
+    } else {
+        matchers.resize(1);
+        matchers[0].Init(data, len, window_size, match_max, match_mode);
+    }
+}
+
+void MatchFinder::Fill(uint32_t pos)
+{
+    uint32_t thread_count = matchers.size();
+    uint32_t range_size = std::min<uint32_t>(size - pos, thread_count * MATCH_BATCH_SIZE);
+    uint32_t chunk_size = (range_size + thread_count - 1) / thread_count;
+    std::vector<std::thread> threads;
+    auto search = [this, pos, range_size, chunk_size](uint32_t index) {
+        HashMatcher &matcher = matchers[index];
+        uint32_t start = index * chunk_size;
+        uint32_t end = std::min(start + chunk_size, range_size);
+        if (start >= end) {
+            return;
+        }
+        matcher.Init(src, size, window, max_len, mode, pos + start);
+        for (uint32_t i = start; i < end; i++) {
+            table_pos[i] = 0;
+            table_len[i] = matcher.Find(pos + i, &table_pos[i]);
+        }
+    };
+    for (uint32_t i = 1; i < thread_count; i++) {
+        threads.push_back(std::thread(search, i));
+    }
+    search(0);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    table_start = pos;
+    table_end = pos + range_size;
+}
+
+// Only for a single thread, which searches as the input streams in.
+void MatchFinder::Rebase(const uint8_t *data, uint32_t data_base)
+{
+    matchers[0].Rebase(data, data_base);
+}
+
+// Same contract as HashMatcher::Find.
+uint32_t MatchFinder::Find(uint32_t pos, uint32_t *pMatchPos)
+{
+    if (matchers.size() == 1) {
+        return matchers[0].Find(pos, pMatchPos);
+    }
+    if (size - pos < 3) {
+        return 1;
+    }
+    if (pos >= table_end) {
+        Fill(pos);
+    }
+    uint32_t len = table_len[pos - table_start];
+    if (len >= 3) {
+        *pMatchPos = table_pos[pos - table_start];
+    }
+    return len;
+}
+
+// Shortest-path parse: given the longest match at every position, cost[]
+// holds the fewest bits needed to encode everything from a position to the
+// end. Any shorter length of a match is available from the same source, so
+// only the longest match per position has to be known. long_len is the
+// first length that needs the long token form. choice[] receives the length
+// to encode at each position (1 for a literal) and may alias match_len[].
+void OptimalParse(uint32_t size, const uint16_t *match_len, uint32_t lit_bits,
+    uint32_t short_bits, uint32_t long_bits, uint32_t long_len, uint16_t *choice)
+{
+    std::vector<uint32_t> cost(size + 1);
+    cost[size] = 0;
+    for (uint32_t pos = size; pos-- > 0;) {
+        uint32_t longest = match_len[pos];
+        uint32_t best = lit_bits + cost[pos + 1];
+        uint32_t best_len = 1;
+        for (uint32_t len = 3; len <= longest; len++) {
+            uint32_t bits = (len < long_len ? short_bits : long_bits) + cost[pos + len];
+            if (bits < best) {
+                best = bits;
+                best_len = len;
+            }
+        }
+        cost[pos] = best;
+        choice[pos] = best_len;
+    }
+}
+
+#define STREAM_BLOCK_SIZE 0x10000
+
+// Input for the encoders: either a whole buffer in memory, or a stream of
+// which only the keep bytes behind the current position and the ahead
+// bytes from it on are held, refilled in large blocks.
+struct StreamWindow
+{
+    StreamReader read;
+    uint32_t size; // of the whole input
+    std::vector<uint8_t> buf;
+    const uint8_t *data;
+    uint32_t base; // input position of data[0]
+    uint32_t end; // input position after the last byte held
+    uint32_t keep;
+    uint32_t ahead;
+    bool failed;
+
+    void Init(ByteSpan src);
+    void Init(const StreamReader &reader, uint32_t len, uint32_t keep_size, uint32_t ahead_size);
+    bool Fill(uint32_t pos);
+    const uint8_t *At(uint32_t pos) { return &data[pos - base]; }
+};
+
+void StreamWindow::Init(ByteSpan src)
+{
+    size = src.size;
+    data = src.data;
+    base = 0;
+    end = src.size;
+    keep = ahead = 0;
+    failed = false;
+}
+
+void StreamWindow::Init(const StreamReader &reader, uint32_t len, uint32_t keep_size, uint32_t ahead_size)
+{
+    read = reader;
+    size = len;
+    keep = keep_size;
+    ahead = ahead_size;
+    buf.resize(keep + ahead + STREAM_BLOCK_SIZE);
+    data = buf.data();
+    base = end = 0;
+    failed = false;
+}
+
+// Makes the input from pos - keep up to pos + ahead available. Returns true
+// if it had to read, which moves the data held.
+bool StreamWindow::Fill(uint32_t pos)
+{
+    if (end >= size || pos + ahead <= end) {
+        return false;
+    }
+    uint32_t new_base = pos > base + keep ? pos - keep : base;
+    memmove(buf.data(), &buf[new_base - base], end - new_base);
+    base = new_base;
+    while (end < size && end - base < buf.size()) {
+        uint32_t len = std::min<uint32_t>(size - end, buf.size() - (end - base));
+        size_t read_len = failed ? 0 : read(&buf[end - base], len);
+        if (read_len == 0) {
+            // a short stream reads as zeros so the encoder can finish
+            failed = true;
+            memset(&buf[end - base], 0, len);
+            read_len = len;
+        }
+        end += read_len;
+    }
+    return true;
+}
+
+#define N 1024   /* size of ring buffer */   
+#define F 66   /* upper limit for match_length */   
+#define THRESHOLD 2 /* encode string into position and length  if match_length is greater than this */
+#define NIL  N /* index for root of binary search trees */   
+
+/* Encoder state for one CompressLzss() call, so several entries can be
+   compressed at once on different threads. */
+struct LzssContext {
+    uint8_t text_buf[N + F - 1];    /* ring buffer of size N,
+            with extra F-1 bytes to facilitate string comparison */
+    int match_position, match_length,  /* of longest match.  These are
+                            set by the InsertNode() procedure. */
+        lson[N + 1], rson[N + 257], dad[N + 1];  /* left & right children &
+                parents -- These constitute binary search trees. */
+
+    void InitTree(void);
+    void InsertNode(int r);
+    void DeleteNode(int p);
+};
+
+void LzssContext::InitTree(void)  /* initialize trees */
+{
+    int  i;
+
+    /* For i = 0 to N - 1, rson[i] and lson[i] will be the right and
+       left children of node i.  These nodes need not be initialized.
+       Also, dad[i] is the parent of node i.  These are initialized to
+       NIL (= N), which stands for 'not used.'
+       For i = 0 to 255, rson[N + i + 1] is the root of the tree
+       for strings that begin with character i.  These are initialized
+       to NIL.  Note there are 256 trees. */
+
+    for (i = N + 1; i <= N + 256; i++) rson[i] = NIL;
+    for (i = 0; i < N; i++) dad[i] = NIL;
+}
+
+void LzssContext::InsertNode(int r)
+/* Inserts string of length F, text_buf[r..r+F-1], into one of the
+   trees (text_buf[r]'th tree) and returns the longest-match position
+   and length via the global variables match_position and match_length.
+   If match_length = F, then removes the old node in favor of the new
+   one, because the old one will be deleted sooner.
+   Note r plays double role, as tree node and position in buffer. */
+{
+    int  i, p, cmp;
+    uint8_t *key;
+
+    cmp = 1;  key = &text_buf[r];  p = N + 1 + key[0];
+    rson[r] = lson[r] = NIL;  match_length = 0;
+    for (; ; ) {
+        if (cmp >= 0) {
+            if (rson[p] != NIL) p = rson[p];
+            else { rson[p] = r;  dad[r] = p;  return; }
+        }
+        else {
+            if (lson[p] != NIL) p = lson[p];
+            else { lson[p] = r;  dad[r] = p;  return; }
+        }
+        i = 1 + MatchPrefix(&key[1], &text_buf[p + 1], F - 1);
+        cmp = i < F ? key[i] - text_buf[p + i] : 0;
+        if (i > match_length) {
+            match_position = p;
+            if ((match_length = i) >= F)  break;
+        }
+    }
+    dad[r] = dad[p];  lson[r] = lson[p];  rson[r] = rson[p];
+    dad[lson[p]] = r;  dad[rson[p]] = r;
+    if (rson[dad[p]] == p) rson[dad[p]] = r;
+    else                   lson[dad[p]] = r;
+    dad[p] = NIL;  /* remove p */
+}
+
+void LzssContext::DeleteNode(int p)  /* deletes node p from tree */
+{
+    int  q;
+
+    if (dad[p] == NIL) return;  /* not in tree */
+    if (rson[p] == NIL) q = lson[p];
+    else if (lson[p] == NIL) q = rson[p];
+    else {
+        q = lson[p];
+        if (rson[q] != NIL) {
+            do { q = rson[q]; } while (rson[q] != NIL);
+            rson[dad[q]] = lson[q];  dad[lson[q]] = dad[q];
+            lson[q] = lson[p];  dad[lson[p]] = q;
+        }
+        rson[q] = rson[p];  dad[rson[p]] = q;
+    }
+    dad[q] = dad[p];
+    if (rson[dad[p]] == p) rson[dad[p]] = q;  else lson[dad[p]] = q;
+    dad[p] = NIL;
+}
+
+uint32_t CompressLzssOptimal(std::vector<uint8_t> &dst, ByteSpan src, const CompressOptions &options)
+{
+    /* The F strings of zeros the tree starts with come first, so input
+       position pos sits at ring position (N - 2 * F + pos) & (N - 1). The
+       tree never holds more than N - F strings, which bounds the distance. */
+    if (src.size == 0) return 0;  /* text of size zero */
+    std::vector<uint8_t> text(F + src.size, 0);
+    memcpy(&text[F], src.data, src.size);
+    uint32_t size = text.size();
+    MatchFinder *matcher = new MatchFinder;
+    matcher->Init(text.data(), size, N - F, F, MATCH_FAST, options.match_threads);
+    std::vector<uint16_t> plan_len(size);
+    std::vector<uint16_t> plan_dist(size);
+    for (uint32_t i = F; i < size; i++) {
+        uint32_t match_pos = 0;
+        plan_len[i] = matcher->Find(i, &match_pos);
+        plan_dist[i] = i - match_pos;
+    }
+    delete matcher;
+    /* literal: flag bit + 8 bits, position and length pair: flag bit + 16 bits */
+    OptimalParse(size - F, &plan_len[F], 9, 17, 17, F + 1, &plan_len[F]);
+
+    int  i, code_buf_ptr;
+    uint8_t code_buf[17], mask;
+    uint32_t codesize = 0;
+    code_buf[0] = 0;
+    code_buf_ptr = mask = 1;
+    for (uint32_t pos = F; pos < size; pos += plan_len[pos]) {
+        if (plan_len[pos] <= THRESHOLD) {
+            code_buf[0] |= mask;  /* 'send one byte' flag */
+            code_buf[code_buf_ptr++] = text[pos];  /* Send uncoded. */
+        }
+        else {
+            int match_position = (N - 2 * F + pos - plan_dist[pos]) & (N - 1);
+            code_buf[code_buf_ptr++] = (uint8_t)match_position;
+            code_buf[code_buf_ptr++] = (uint8_t)
+                (((match_position >> 2) & 0xC0)
+                    | (plan_len[pos] - (THRESHOLD + 1)));
+        }
+        if ((mask <<= 1) == 0) {  /* Shift mask left one bit. */
+            for (i = 0; i < code_buf_ptr; i++) WriteU8(dst, code_buf[i]);
+            codesize += code_buf_ptr;
+            code_buf[0] = 0;  code_buf_ptr = mask = 1;
+        }
+    }
+    if (code_buf_ptr > 1) {         /* Send remaining code. */
+        for (i = 0; i < code_buf_ptr; i++) WriteU8(dst, code_buf[i]);
+        codesize += code_buf_ptr;
+    }
+    return codesize;
+}
+
+uint32_t CompressLzssWindow(StreamWindow &in, const StreamSink &sink)
+{
+    int  i, len, r, s, last_match_length, code_buf_ptr;
+    uint32_t src_pos;
+    uint8_t code_buf[17], mask;
+    uint32_t codesize = 0;
+    LzssContext ctx = {};  /* zeroed so the lookahead past the end of
+            the text compares the same on every run */
+
+    ctx.InitTree();  /* initialize trees */
+    code_buf[0] = 0;  /* code_buf[1..16] saves eight units of code, and
+            code_buf[0] works as eight flags, "1" representing that the unit
+            is an unencoded letter (1 byte), "0" a position-and-length pair
+            (2 bytes).  Thus, eight units require at most 16 bytes of code. */
+    code_buf_ptr = mask = 1;
+    s = 0;  r = N - F;
+    for (i = s; i < r; i++) ctx.text_buf[i] = '\0';  /* Clear the buffer with
+            any character that will appear often. */
+    len = std::min<uint32_t>(F, in.size);
+    if (len == 0) return 0;  /* text of size zero */
+    in.Fill(0);
+    memcpy(&ctx.text_buf[r], in.At(0), len);  /* Read F bytes into the last F
+            bytes of the buffer */
+    src_pos = len;
+    for (i = 1; i <= F; i++) ctx.InsertNode(r - i);  /* Insert the F strings,
+            each of which begins with one or more 'space' characters.  Note
+            the order in which these strings are inserted.  This way,
+            degenerate trees will be less likely to occur. */
+    ctx.InsertNode(r);  /* Finally, insert the whole string just read.  The
+            context's match_length and match_position are set. */
+    do {
+        if (ctx.match_length > len) ctx.match_length = len;  /* match_length
+                may be spuriously long near the end of text. */
+        if (ctx.match_length <= THRESHOLD) {
+            ctx.match_length = 1;  /* Not long enough match.  Send one byte. */
+            code_buf[0] |= mask;  /* 'send one byte' flag */
+            code_buf[code_buf_ptr++] = ctx.text_buf[r];  /* Send uncoded. */
+        }
+        else {
+            code_buf[code_buf_ptr++] = (uint8_t)ctx.match_position;
+            code_buf[code_buf_ptr++] = (uint8_t)
+                (((ctx.match_position >> 2) & 0xC0)
+                    | (ctx.match_length - (THRESHOLD + 1)));  /* Send position and
+                                  length pair. Note match_length > THRESHOLD. */
+        }
+        if ((mask <<= 1) == 0) {  /* Shift mask left one bit. */
+            sink.write(code_buf, code_buf_ptr);  /* Send at most 8 units of
+                    code together */
+            codesize += code_buf_ptr;
+            code_buf[0] = 0;  code_buf_ptr = mask = 1;
+        }
+        last_match_length = ctx.match_length;
+        for (i = 0; i < last_match_length &&
+            src_pos < in.size; i++) {
+            in.Fill(src_pos);
+            uint8_t c = *in.At(src_pos++);
+            ctx.DeleteNode(s);          /* Delete old strings and */
+            ctx.text_buf[s] = c;        /* read new bytes */
+            if (s < F - 1) ctx.text_buf[s + N] = c;  /* If the position is
+                    near the end of buffer, extend the buffer to make
+                    string comparison easier. */
+            s = (s + 1) & (N - 1);  r = (r + 1) & (N - 1);
+            /* Since this is a ring buffer, increment the position
+               modulo N. */
+            ctx.InsertNode(r);  /* Register the string in text_buf[r..r+F-1] */
+        }
+        while (i++ < last_match_length) {       /* After the end of text, */
+            ctx.DeleteNode(s);                                  /* no need to read, but */
+            s = (s + 1) & (N - 1);  r = (r + 1) & (N - 1);
+            if (--len) ctx.InsertNode(r);               /* buffer may not be empty. */
+        }
+    } while (len > 0);      /* until length of string to be processed is zero */
+    if (code_buf_ptr > 1) {         /* Send remaining code. */
+        sink.write(code_buf, code_buf_ptr);
+        codesize += code_buf_ptr;
+    }
+    return codesize;
+}
+
+uint32_t CompressLzss(std::vector<uint8_t> &dst, ByteSpan src, const CompressOptions &options)
+{
+    StreamWindow in;
+    if (options.optimal_parse) {
+        return CompressLzssOptimal(dst, src, options);
+    }
+    in.Init(src);
+    return CompressLzssWindow(in, MakeVectorSink(dst));
+}
+
+// lookahead state carried between nintendoEnc calls of one CompressSlide
+struct SlideContext
+{
+    uint32_t numBytes1;
+    uint32_t matchPos;
+    int prevFlag;
+    MatchFinder matcher;
+};
+
+// a lookahead encoding scheme for ngc Yaz0
+uint32_t nintendoEnc(SlideContext *ctx, uint32_t pos, uint32_t *pMatchPos)
+{
+    uint32_t numBytes = 1;
+
+    // if prevFlag is set, it means that the previous position was determined by look-ahead try.
+    // so just use it. this is not the best optimization, but nintendo's choice for speed.
+    if (ctx->prevFlag == 1) {
+        *pMatchPos = ctx->matchPos;
+        ctx->prevFlag = 0;
+        return ctx->numBytes1;
+    }
+    ctx->prevFlag = 0;
+    numBytes = ctx->matcher.Find(pos, &ctx->matchPos);
+    *pMatchPos = ctx->matchPos;
+
+    // if this position is RLE encoded, then compare to copying 1 byte and next position(pos+1) encoding
+    if (numBytes >= 3) {
+        ctx->numBytes1 = ctx->matcher.Find(pos + 1, &ctx->matchPos);
+        // if the next position encoding is +2 longer than current position, choose it.
+        // this does not guarantee the best optimization, but fairly good optimization with speed.
+        if (ctx->numBytes1 >= numBytes + 2) {
+            numBytes = 1;
+            ctx->prevFlag = 1;
+        }
+    }
+    return numBytes;
+}
+
+struct Ret
+{
+    uint32_t srcPos, dstPos;
+};
+
+uint32_t CompressSlideWindow(StreamWindow &in, const StreamSink &sink, const CompressOptions &options)
+{
+    Ret r = { 0, 0 };
+    SlideContext *ctx = new SlideContext;
+    uint8_t dst[96];    // 32 codes * 3 bytes maximum
+    uint32_t dstSize = 4;
+
+    uint32_t validBitCount = 0; //number of valid bits left in "code" byte
+    uint32_t currCodeByte = 0;
+    uint32_t len = in.size;
+    std::vector<uint16_t> plan_len;
+    std::vector<uint16_t> plan_dist;
+    ctx->prevFlag = 0;
+    if (options.optimal_parse) {
+        // the plan only needs the longest match, so search in fast mode
+        ctx->matcher.Init(in.data, len, SLIDE_WINDOW, SLIDE_MAX_LEN, MATCH_FAST, options.match_threads);
+        plan_len.resize(len);
+        plan_dist.resize(len);
+        for (uint32_t i = 0; i < len; i++) {
+            uint32_t matchPos = 0;
+            plan_len[i] = ctx->matcher.Find(i, &matchPos);
+            plan_dist[i] = i - matchPos;
+        }
+        // literal: 8 bits, 2 byte code: 16 bits, 3 byte code: 24 bits, plus a flag bit each
+        OptimalParse(len, plan_len.data(), 9, 17, 25, 0x12, plan_len.data());
+    } else {
+        // the greedy parse only searches where a token starts, a fraction of
+        // the positions a MatchFinder batch covers, so it stays on one thread
+        ctx->matcher.Init(in.data, len, SLIDE_WINDOW, SLIDE_MAX_LEN, options.match_mode, 1);
+    }
+    WriteU32(sink, len);
+    while (r.srcPos < len)
+    {
+        uint32_t numBytes;
+        uint32_t matchPos;
+        uint32_t srcPosBak;
+
+        if (in.Fill(r.srcPos)) {
+            ctx->matcher.Rebase(in.data, in.base);
+        }
+        if (options.optimal_parse) {
+            numBytes = plan_len[r.srcPos];
+            matchPos = r.srcPos - plan_dist[r.srcPos];
+        } else {
+            numBytes = nintendoEnc(ctx, r.srcPos, &matchPos);
+        }
+        if (numBytes < 3)
+        {
+            //straight copy
+            dst[r.dstPos] = *in.At(r.srcPos);
+            r.dstPos++;
+            r.srcPos++;
+            //set flag for straight copy
+            currCodeByte |= (0x80000000 >> validBitCount);
+        }
+        else
+        {
+            //RLE part
+            uint32_t dist = r.srcPos - matchPos - 1;
+            uint8_t byte1, byte2, byte3;
+
+            if (numBytes >= 0x12)  // 3 byte encoding
+            {
+                byte1 = 0 | (dist >> 8);
+                byte2 = dist & 0xff;
+                dst[r.dstPos++] = byte1;
+                dst[r.dstPos++] = byte2;
+                // maximum runlength for 3 byte encoding
+                if (numBytes > 0xff + 0x12)
+                    numBytes = 0xff + 0x12;
+                byte3 = numBytes - 0x12;
+                dst[r.dstPos++] = byte3;
+            }
+            else  // 2 byte encoding
+            {
+                byte1 = ((numBytes - 2) << 4) | (dist >> 8);
+                byte2 = dist & 0xff;
+                dst[r.dstPos++] = byte1;
+                dst[r.dstPos++] = byte2;
+            }
+            r.srcPos += numBytes;
+        }
+        validBitCount++;
+        //write 32 codes
+        if (validBitCount == 32)
+        {
+            WriteU32(sink, currCodeByte);
+            sink.write(dst, r.dstPos);
+            dstSize += r.dstPos + 4;
+
+            srcPosBak = r.srcPos;
+            currCodeByte = 0;
+            validBitCount = 0;
+            r.dstPos = 0;
+        }
+    }
+    if (validBitCount > 0)
+    {
+        WriteU32(sink, currCodeByte);
+        sink.write(dst, r.dstPos);
+        dstSize += r.dstPos + 4;
+
+        currCodeByte = 0;
+        validBitCount = 0;
+        r.dstPos = 0;
+    }
+    delete ctx;
+    return dstSize;
+}
+
+uint32_t CompressSlide(std::vector<uint8_t> &file_dst, ByteSpan src, const CompressOptions &options)
+{
+    StreamWindow in;
+    in.Init(src);
+    return CompressSlideWindow(in, MakeVectorSink(file_dst), options);
+}
+
+// Tokens are gathered here and handed to the sink in blocks this large
+#define RLE_OUT_BLOCK 0x10000
+
+// A run takes up to 127 bytes while each byte equals the next, and a
+// literal up to 127 while each differs from the next. The encoder looks one
+// byte past the end of the input, which reads as zero.
+uint32_t CompressRleWindow(StreamWindow &in, const StreamSink &sink)
+{
+    uint32_t output_pos = 0;
+    uint32_t input_pos = 0;
+    uint32_t copy_len = 0;
+    uint32_t len = in.size;
+    std::vector<uint8_t> out;
+    out.reserve(RLE_OUT_BLOCK + 128);
+    while (input_pos < len) {
+        in.Fill(input_pos);
+        const uint8_t *run = in.At(input_pos);
+        uint32_t left = len - input_pos;
+        uint32_t max_len = std::min<uint32_t>(left, 127);
+        // pairs with both bytes inside the input; the one after compares
+        // the last byte with zero
+        uint32_t pairs = max_len < left ? max_len : max_len - 1;
+        bool at_end = pairs < max_len;
+        if (pairs > 0 ? run[0] == run[1] : run[0] == 0) {
+            copy_len = MatchPrefix(run, run + 1, pairs);
+            if (copy_len == pairs && at_end && run[pairs] == 0) {
+                copy_len++;
+            }
+            out.push_back(copy_len);
+            out.push_back(run[0]);
+            output_pos += 2;
+        }
+        else {
+            copy_len = FindEqualPair(run, pairs);
+            if (copy_len == pairs && at_end && run[pairs] != 0) {
+                copy_len++;
+            }
+            out.push_back(copy_len | 0x80);
+            out.insert(out.end(), run, run + copy_len);
+            output_pos += copy_len + 1;
+        }
+        input_pos += copy_len;
+        if (out.size() >= RLE_OUT_BLOCK) {
+            sink.write(out.data(), out.size());
+            out.clear();
+        }
+    }
+    if (!out.empty()) {
+        sink.write(out.data(), out.size());
+    }
+    return output_pos;
+}
+
+uint32_t CompressRle(std::vector<uint8_t> &file_dst, ByteSpan src)
+{
+    StreamWindow in;
+    in.Init(src);
+    return CompressRleWindow(in, MakeVectorSink(file_dst));
+}
+
+uint32_t CompressZlib(std::vector<uint8_t> &file_dst, ByteSpan src)
+{
+    int ret;
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+    if (ret != Z_OK)
+    {
+        return 0;
+    }
+    // deflate reads the input in place and writes straight into the output,
+    // which deflateBound sizes so that a single call finishes the stream
+    size_t header_ofs = file_dst.size();
+    uint32_t output_max = deflateBound(&strm, src.size);
+    WriteU32(file_dst, src.size);
+    WriteU32(file_dst, 0);
+    file_dst.resize(header_ofs + 8 + output_max);
+    strm.next_in = (Bytef *)src.data;
+    strm.avail_in = src.size;
+    strm.next_out = &file_dst[header_ofs + 8];
+    strm.avail_out = output_max;
+    ret = deflate(&strm, Z_FINISH);
+    uint32_t output_size = output_max - strm.avail_out;
+    (void)deflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        file_dst.resize(header_ofs);
+        return 0;
+    }
+    file_dst.resize(header_ofs + 8 + output_size);
+    PatchU32(file_dst, header_ofs + 4, output_size);
+    return output_size+8;
+}
+
+// Deflates the input a block at a time, so neither it nor the output is
+// held whole. The compressed length is filled in once the stream ends.
+bool CompressZlibStream(const StreamReader &read, uint32_t size, const StreamSink &sink, uint32_t *comp_size)
+{
+    int ret;
+    z_stream strm;
+    std::vector<uint8_t> in(STREAM_BLOCK_SIZE);
+    std::vector<uint8_t> out(STREAM_BLOCK_SIZE);
+    uint32_t read_size = 0;
+    uint32_t output_size = 0;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+    if (ret != Z_OK)
+    {
+        return false;
+    }
+    WriteU32(sink, size);
+    WriteU32(sink, 0);
+    strm.avail_in = 0;
+    while (ret != Z_STREAM_END) {
+        if (strm.avail_in == 0 && read_size < size) {
+            size_t len = read(in.data(), std::min<uint32_t>(size - read_size, in.size()));
+            if (len == 0) {
+                break;
+            }
+            read_size += len;
+            strm.next_in = in.data();
+            strm.avail_in = len;
+        }
+        strm.next_out = out.data();
+        strm.avail_out = out.size();
+        ret = deflate(&strm, read_size == size ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            break;
+        }
+        sink.write(out.data(), out.size() - strm.avail_out);
+        output_size += out.size() - strm.avail_out;
+    }
+    (void)deflateEnd(&strm);
+    uint8_t buf[4] = { (uint8_t)(output_size >> 24), (uint8_t)(output_size >> 16),
+        (uint8_t)(output_size >> 8), (uint8_t)output_size };
+    sink.patch(4, buf, sizeof(buf));
+    *comp_size = output_size + 8;
+    return ret == Z_STREAM_END;
+}
+
+// Built-in deflate encoder for zlib entries, used when zlib_iterations is
+// set. Every chunk of DEFLATE_CHUNK_SIZE input bytes is parsed for the
+// fewest bits under a cost model taken from the symbols of the previous
+// pass, then cut into blocks wherever new Huffman codes pay for their
+// header. Chunks only look back into the 32 KB before them, so they are
+// parsed on separate threads and their blocks written one after another
+// into a single stream; the output does not depend on the thread count.
+
+#define DEFLATE_WINDOW 0x8000
+#define DEFLATE_MAX_LEN 258
+#define DEFLATE_HASH_BITS 15
+// Candidates visited per position, the longest chain zlib -9 follows
+#define DEFLATE_MAX_CHAIN 4096
+#define DEFLATE_CHUNK_SIZE 0x40000
+#define DEFLATE_STATS_STEP 64
+// Blocks are only split where both halves keep at least this many symbols
+#define DEFLATE_MIN_BLOCK 1024
+// Split points tried in each round of narrowing down the best one
+#define DEFLATE_SPLIT_TRIES 9
+#define DEFLATE_STORED_MAX 0xFFFF
+
+static const uint16_t deflate_len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43,
+    51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t deflate_len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4,
+    4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t deflate_dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257,
+    385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t deflate_dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9,
+    10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t deflate_codelen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1,
+    15 };
+
+// Length codes minus 257 by length, and distance codes by distance - 1 up to
+// 256 and by (distance - 1) / 128 beyond, as zlib looks them up
+struct DeflateCodeTables
+{
+    uint8_t len[DEFLATE_MAX_LEN + 1];
+    uint8_t dist[512];
+
+    DeflateCodeTables()
+    {
+        for (uint32_t sym = 0; sym < 29; sym++) {
+            for (uint32_t len_ofs = 0; len_ofs < (1U << deflate_len_extra[sym]); len_ofs++) {
+                if (deflate_len_base[sym] + len_ofs <= DEFLATE_MAX_LEN) {
+                    len[deflate_len_base[sym] + len_ofs] = sym;
+                }
+            }
+        }
+        for (uint32_t sym = 0; sym < 30; sym++) {
+            for (uint32_t dist_ofs = 0; dist_ofs < (1U << deflate_dist_extra[sym]); dist_ofs++) {
+                uint32_t value = deflate_dist_base[sym] - 1 + dist_ofs;
+                if (value < 256) {
+                    dist[value] = sym;
+                } else {
+                    dist[256 + (value >> 7)] = sym;
+                }
+            }
+        }
+    }
+};
+
+static const DeflateCodeTables deflate_codes;
+
+static uint32_t GetLengthSymbol(uint32_t len)
+{
+    return deflate_codes.len[len];
+}
+
+static uint32_t GetDistSymbol(uint32_t dist)
+{
+    uint32_t value = dist - 1;
+    return value < 256 ? deflate_codes.dist[value] : deflate_codes.dist[256 + (value >> 7)];
+}
+
+// A literal when dist is 0, with its byte in litlen, or else a match
+struct DeflateSymbol
+{
+    uint16_t litlen;
+    uint16_t dist;
+};
+
+// Nearest distance at which a match reaches len bytes
+struct DeflateMatch
+{
+    uint16_t len;
+    uint16_t dist;
+};
+
+struct DeflateStats
+{
+    uint32_t litlen[288];
+    uint32_t dist[30];
+};
+
+// Bits each literal, length and distance costs, extra bits included
+struct DeflateCosts
+{
+    double lit[256];
+    double len[DEFLATE_MAX_LEN + 1];
+    double dist[30];
+};
+
+// A block's code lengths and the run length coded form a dynamic block
+// header describes them in
+struct DeflateTrees
+{
+    uint8_t litlen_lengths[288];
+    uint8_t dist_lengths[30];
+    uint8_t codelen_lengths[19];
+    uint32_t hlit;
+    uint32_t hdist;
+    uint32_t hclen;
+    std::vector<uint8_t> header; // code length symbols, each followed by its extra bits
+};
+
+// Deflate fills bytes from the least significant bit up
+struct BitWriter
+{
+    std::vector<uint8_t> data;
+    uint64_t bit_count = 0;
+
+    void Write(uint32_t value, uint32_t bits)
+    {
+        for (uint32_t i = 0; i < bits; i++) {
+            if ((bit_count & 7) == 0) {
+                data.push_back(0);
+            }
+            data.back() |= ((value >> i) & 1) << (bit_count & 7);
+            bit_count++;
+        }
+    }
+
+    // Huffman codes go most significant bit first
+    void WriteCode(uint32_t code, uint32_t bits)
+    {
+        for (uint32_t i = bits; i-- > 0;) {
+            Write(code >> i, 1);
+        }
+    }
+
+    void AlignByte()
+    {
+        bit_count = (uint64_t)data.size() * 8;
+    }
+};
+
+struct DeflateChunk
+{
+    std::vector<DeflateSymbol> symbols;
+    std::vector<uint32_t> block_ends; // symbol index each block ends at
+};
+
+// Builds lengths for a Huffman code over freqs, none longer than max_bits,
+// halving the frequencies until the tree is shallow enough. At least two
+// symbols always get a length, since some inflaters reject a code with one.
+static void GetHuffmanLengths(const uint32_t *freqs, uint32_t count, uint32_t max_bits, uint8_t *lengths)
+{
+    std::vector<uint32_t> weights(freqs, freqs + count);
+    std::vector<uint32_t> order;
+    memset(lengths, 0, count);
+    for (uint32_t i = 0; i < count; i++) {
+        if (weights[i] != 0) {
+            order.push_back(i);
+        }
+    }
+    if (order.size() < 2) {
+        uint32_t used = order.empty() ? 1 : order[0];
+        lengths[used] = 1;
+        lengths[used == 0 ? 1 : 0] = 1;
+        return;
+    }
+    uint32_t leaf_count = order.size();
+    uint32_t node_count = leaf_count * 2 - 1;
+    std::vector<uint64_t> node_weight(node_count);
+    std::vector<uint32_t> parent(node_count);
+    std::vector<uint32_t> depth(node_count);
+    for (;;) {
+        std::stable_sort(order.begin(), order.end(), [&weights](uint32_t a, uint32_t b) {
+            return weights[a] < weights[b];
+        });
+        // Leaves come first, sorted, then internal nodes in the order they
+        // are made, which is also by weight; each step joins the two
+        // lightest of either
+        for (uint32_t i = 0; i < leaf_count; i++) {
+            node_weight[i] = weights[order[i]];
+        }
+        uint32_t next_leaf = 0;
+        uint32_t next_node = leaf_count;
+        for (uint32_t node = leaf_count; node < node_count; node++) {
+            node_weight[node] = 0;
+            for (uint32_t k = 0; k < 2; k++) {
+                uint32_t child;
+                if (next_leaf < leaf_count && (next_node == node || node_weight[next_leaf] <= node_weight[next_node])) {
+                    child = next_leaf++;
+                } else {
+                    child = next_node++;
+                }
+                node_weight[node] += node_weight[child];
+                parent[child] = node;
+            }
+        }
+        uint32_t max_depth = 0;
+        depth[node_count - 1] = 0;
+        for (uint32_t node = node_count - 1; node-- > 0;) {
+            depth[node] = depth[parent[node]] + 1;
+            max_depth = std::max(max_depth, depth[node]);
+        }
+        if (max_depth <= max_bits) {
+            for (uint32_t i = 0; i < leaf_count; i++) {
+                lengths[order[i]] = depth[i];
+            }
+            return;
+        }
+        for (uint32_t i = 0; i < leaf_count; i++) {
+            weights[order[i]] = (weights[order[i]] + 1) / 2;
+        }
+    }
+}
+
+static void GetHuffmanCodes(const uint8_t *lengths, uint32_t count, uint16_t *codes)
+{
+    uint32_t length_count[16] = { 0 };
+    uint32_t next_code[16];
+    for (uint32_t i = 0; i < count; i++) {
+        length_count[lengths[i]]++;
+    }
+    length_count[0] = 0;
+    uint32_t code = 0;
+    for (uint32_t bits = 1; bits < 16; bits++) {
+        code = (code + length_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        codes[i] = lengths[i] != 0 ? next_code[lengths[i]]++ : 0;
+    }
+}
+
+static void GetFixedLengths(uint8_t *litlen_lengths, uint8_t *dist_lengths)
+{
+    for (uint32_t i = 0; i < 288; i++) {
+        litlen_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    for (uint32_t i = 0; i < 30; i++) {
+        dist_lengths[i] = 5;
+    }
+}
+
+static void AddSymbols(const DeflateSymbol *symbols, uint32_t count, DeflateStats &stats)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (symbols[i].dist == 0) {
+            stats.litlen[symbols[i].litlen]++;
+        } else {
+            stats.litlen[257 + GetLengthSymbol(symbols[i].litlen)]++;
+            stats.dist[GetDistSymbol(symbols[i].dist)]++;
+        }
+    }
+}
+
+// Counts the symbols of a block, end of block included
+static void CountSymbols(const DeflateSymbol *symbols, uint32_t count, DeflateStats &stats)
+{
+    memset(&stats, 0, sizeof(stats));
+    AddSymbols(symbols, count, stats);
+    stats.litlen[256] = 1;
+}
+
+// Symbol counts from the start of a chunk up to every DEFLATE_STATS_STEP-th
+// symbol, so the split search counts any block without walking all of it
+struct DeflateStatsIndex
+{
+    const DeflateSymbol *symbols;
+    std::vector<DeflateStats> prefix;
+
+    void Init(const DeflateSymbol *chunk_symbols, uint32_t count)
+    {
+        symbols = chunk_symbols;
+        prefix.resize(count / DEFLATE_STATS_STEP + 1);
+        memset(&prefix[0], 0, sizeof(DeflateStats));
+        for (uint32_t i = 1; i < prefix.size(); i++) {
+            prefix[i] = prefix[i - 1];
+            AddSymbols(&symbols[(i - 1) * DEFLATE_STATS_STEP], DEFLATE_STATS_STEP, prefix[i]);
+        }
+    }
+
+    void GetPrefix(uint32_t end, DeflateStats &stats)
+    {
+        uint32_t step = end / DEFLATE_STATS_STEP;
+        stats = prefix[step];
+        AddSymbols(&symbols[step * DEFLATE_STATS_STEP], end - step * DEFLATE_STATS_STEP, stats);
+    }
+
+    void Get(uint32_t start, uint32_t end, DeflateStats &stats)
+    {
+        DeflateStats before;
+        GetPrefix(start, before);
+        GetPrefix(end, stats);
+        for (uint32_t i = 0; i < 288; i++) {
+            stats.litlen[i] -= before.litlen[i];
+        }
+        for (uint32_t i = 0; i < 30; i++) {
+            stats.dist[i] -= before.dist[i];
+        }
+        stats.litlen[256] = 1;
+    }
+};
+
+static void AddHeaderSymbol(DeflateTrees &trees, uint8_t sym, uint8_t extra, uint32_t *freqs)
+{
+    trees.header.push_back(sym);
+    trees.header.push_back(extra);
+    freqs[sym]++;
+}
+
+static void BuildTrees(const DeflateStats &stats, DeflateTrees &trees)
+{
+    memset(trees.litlen_lengths, 0, sizeof(trees.litlen_lengths));
+    GetHuffmanLengths(stats.litlen, 286, 15, trees.litlen_lengths);
+    GetHuffmanLengths(stats.dist, 30, 15, trees.dist_lengths);
+    trees.hlit = 286;
+    while (trees.hlit > 257 && trees.litlen_lengths[trees.hlit - 1] == 0) {
+        trees.hlit--;
+    }
+    trees.hdist = 30;
+    while (trees.hdist > 1 && trees.dist_lengths[trees.hdist - 1] == 0) {
+        trees.hdist--;
+    }
+    // Both lists of lengths are coded as one, runs may cross between them
+    uint8_t lengths[286 + 30];
+    uint32_t count = trees.hlit + trees.hdist;
+    memcpy(lengths, trees.litlen_lengths, trees.hlit);
+    memcpy(&lengths[trees.hlit], trees.dist_lengths, trees.hdist);
+    uint32_t freqs[19] = { 0 };
+    trees.header.clear();
+    for (uint32_t i = 0; i < count;) {
+        uint8_t value = lengths[i];
+        uint32_t run = 1;
+        while (i + run < count && lengths[i + run] == value) {
+            run++;
+        }
+        i += run;
+        if (value == 0) {
+            for (; run >= 11; run -= std::min<uint32_t>(run, 138)) {
+                AddHeaderSymbol(trees, 18, std::min<uint32_t>(run, 138) - 11, freqs);
+            }
+            if (run >= 3) {
+                AddHeaderSymbol(trees, 17, run - 3, freqs);
+                run = 0;
+            }
+        } else {
+            AddHeaderSymbol(trees, value, 0, freqs);
+            for (run--; run >= 3; run -= std::min<uint32_t>(run, 6)) {
+                AddHeaderSymbol(trees, 16, std::min<uint32_t>(run, 6) - 3, freqs);
+            }
+        }
+        for (; run > 0; run--) {
+            AddHeaderSymbol(trees, value, 0, freqs);
+        }
+    }
+    GetHuffmanLengths(freqs, 19, 7, trees.codelen_lengths);
+    trees.hclen = 19;
+    while (trees.hclen > 4 && trees.codelen_lengths[deflate_codelen_order[trees.hclen - 1]] == 0) {
+        trees.hclen--;
+    }
+}
+
+static uint32_t GetHeaderExtraBits(uint32_t sym)
+{
+    return sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0;
+}
+
+static uint64_t GetHeaderBits(const DeflateTrees &trees)
+{
+    uint64_t bits = 14 + trees.hclen * 3;
+    for (size_t i = 0; i < trees.header.size(); i += 2) {
+        bits += trees.codelen_lengths[trees.header[i]] + GetHeaderExtraBits(trees.header[i]);
+    }
+    return bits;
+}
+
+static uint64_t GetDataBits(const DeflateStats &stats, const uint8_t *litlen_lengths, const uint8_t *dist_lengths)
+{
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < 286; i++) {
+        bits += (uint64_t)stats.litlen[i] * (litlen_lengths[i] + (i > 256 ? deflate_len_extra[i - 257] : 0));
+    }
+    for (uint32_t i = 0; i < 30; i++) {
+        bits += (uint64_t)stats.dist[i] * (dist_lengths[i] + deflate_dist_extra[i]);
+    }
+    return bits;
+}
+
+static uint64_t GetStoredBits(uint32_t raw_size)
+{
+    uint64_t pieces = std::max<uint32_t>((raw_size + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX, 1);
+    // block type, padding to a byte at worst, then the two length fields
+    return pieces * (3 + 7 + 32) + (uint64_t)raw_size * 8;
+}
+
+// Returns the size in bits of the smallest of the three block types, which
+// goes in btype: 0 stored, 1 fixed codes, 2 dynamic codes.
+static uint64_t ChooseBlockType(const DeflateStats &stats, const DeflateTrees &trees, uint32_t raw_size,
+    uint32_t *btype)
+{
+    uint8_t fixed_litlen[288];
+    uint8_t fixed_dist[30];
+    GetFixedLengths(fixed_litlen, fixed_dist);
+    uint64_t best = GetStoredBits(raw_size);
+    uint64_t bits = 3 + GetDataBits(stats, fixed_litlen, fixed_dist);
+    *btype = 0;
+    if (bits < best) {
+        best = bits;
+        *btype = 1;
+    }
+    bits = 3 + GetHeaderBits(trees) + GetDataBits(stats, trees.litlen_lengths, trees.dist_lengths);
+    if (bits < best) {
+        best = bits;
+        *btype = 2;
+    }
+    return best;
+}
+
+static uint64_t GetBlockBits(const DeflateStats &stats, uint32_t raw_size)
+{
+    DeflateTrees trees;
+    uint32_t btype;
+    BuildTrees(stats, trees);
+    return ChooseBlockType(stats, trees, raw_size, &btype);
+}
+
+static void WriteDeflateBlock(BitWriter &out, const DeflateSymbol *symbols, uint32_t count, const uint8_t *raw,
+    uint32_t raw_size, bool last)
+{
+    DeflateStats stats;
+    DeflateTrees trees;
+    uint32_t btype;
+    CountSymbols(symbols, count, stats);
+    BuildTrees(stats, trees);
+    ChooseBlockType(stats, trees, raw_size, &btype);
+    if (btype == 0) {
+        uint32_t ofs = 0;
+        do {
+            uint32_t len = std::min<uint32_t>(raw_size - ofs, DEFLATE_STORED_MAX);
+            out.Write(last && ofs + len == raw_size, 1);
+            out.Write(0, 2);
+            out.AlignByte();
+            out.Write(len, 16);
+            out.Write(~len & 0xFFFF, 16);
+            WriteBytes(out.data, &raw[ofs], len);
+            out.bit_count += (uint64_t)len * 8;
+            ofs += len;
+        } while (ofs < raw_size);
+        return;
+    }
+    uint8_t fixed_litlen[288];
+    uint8_t fixed_dist[30];
+    const uint8_t *litlen_lengths = trees.litlen_lengths;
+    const uint8_t *dist_lengths = trees.dist_lengths;
+    out.Write(last, 1);
+    out.Write(btype, 2);
+    if (btype == 1) {
+        GetFixedLengths(fixed_litlen, fixed_dist);
+        litlen_lengths = fixed_litlen;
+        dist_lengths = fixed_dist;
+    } else {
+        uint16_t codelen_codes[19];
+        GetHuffmanCodes(trees.codelen_lengths, 19, codelen_codes);
+        out.Write(trees.hlit - 257, 5);
+        out.Write(trees.hdist - 1, 5);
+        out.Write(trees.hclen - 4, 4);
+        for (uint32_t i = 0; i < trees.hclen; i++) {
+            out.Write(trees.codelen_lengths[deflate_codelen_order[i]], 3);
+        }
+        for (size_t i = 0; i < trees.header.size(); i += 2) {
+            uint32_t sym = trees.header[i];
+            out.WriteCode(codelen_codes[sym], trees.codelen_lengths[sym]);
+            out.Write(trees.header[i + 1], GetHeaderExtraBits(sym));
+        }
+    }
+    uint16_t litlen_codes[288];
+    uint16_t dist_codes[30];
+    GetHuffmanCodes(litlen_lengths, 288, litlen_codes);
+    GetHuffmanCodes(dist_lengths, 30, dist_codes);
+    for (uint32_t i = 0; i < count; i++) {
+        const DeflateSymbol &symbol = symbols[i];
+        if (symbol.dist == 0) {
+            out.WriteCode(litlen_codes[symbol.litlen], litlen_lengths[symbol.litlen]);
+            continue;
+        }
+        uint32_t sym = GetLengthSymbol(symbol.litlen);
+        out.WriteCode(litlen_codes[257 + sym], litlen_lengths[257 + sym]);
+        out.Write(symbol.litlen - deflate_len_base[sym], deflate_len_extra[sym]);
+        sym = GetDistSymbol(symbol.dist);
+        out.WriteCode(dist_codes[sym], dist_lengths[sym]);
+        out.Write(symbol.dist - deflate_dist_base[sym], deflate_dist_extra[sym]);
+    }
+    out.WriteCode(litlen_codes[256], litlen_lengths[256]);
+}
+
+static uint32_t DeflateHash(const uint8_t *key)
+{
+    uint32_t value = (key[0] << 16) | (key[1] << 8) | key[2];
+    return (value * 2654435761U) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Lists the matches at every position from start to end as the lengths at
+// which the nearest match grows, each with its distance. Matches end by
+// end, so a chunk's parse never runs into the next one.
+static void FindDeflateMatches(ByteSpan src, uint32_t start, uint32_t end, std::vector<uint32_t> &match_start,
+    std::vector<DeflateMatch> &matches)
+{
+    uint32_t window_start = start > DEFLATE_WINDOW ? start - DEFLATE_WINDOW : 0;
+    std::vector<int32_t> head(1 << DEFLATE_HASH_BITS, -1);
+    std::vector<int32_t> prev(end - window_start);
+    match_start.resize(end - start + 1);
+    matches.clear();
+    for (uint32_t pos = window_start; pos < end; pos++) {
+        if (pos >= start) {
+            match_start[pos - start] = matches.size();
+        }
+        if (pos + 3 > src.size) {
+            continue;
+        }
+        uint32_t hash = DeflateHash(&src.data[pos]);
+        uint32_t len_left = std::min<uint32_t>(end - pos, DEFLATE_MAX_LEN);
+        if (pos >= start && len_left >= 3) {
+            const uint8_t *pos_data = &src.data[pos];
+            int32_t limit = pos > DEFLATE_WINDOW ? pos - DEFLATE_WINDOW : 0;
+            uint32_t best_len = 2;
+            uint32_t steps = 0;
+            for (int32_t cand = head[hash]; cand >= limit && steps < DEFLATE_MAX_CHAIN;
+                cand = prev[cand - window_start], steps++) {
+                const uint8_t *cand_data = &src.data[cand];
+                if (cand_data[best_len] != pos_data[best_len]) {
+                    continue;
+                }
+                uint32_t len = MatchPrefix(cand_data, pos_data, len_left);
+                if (len > best_len) {
+                    best_len = len;
+                    matches.push_back({ (uint16_t)len, (uint16_t)(pos - cand) });
+                    if (len == len_left) {
+                        break;
+                    }
+                }
+            }
+        }
+        prev[pos - window_start] = head[hash];
+        head[hash] = pos;
+    }
+    match_start[end - start] = matches.size();
+}
+
+// Turns symbol counts into costs as their entropy; unused symbols cost as
+// much as ones used once. Without stats the fixed codes' lengths are used.
+static void GetDeflateCosts(const DeflateStats *stats, DeflateCosts &costs)
+{
+    double litlen_bits[286];
+    double dist_bits[30];
+    if (stats == NULL) {
+        uint8_t litlen_lengths[288];
+        uint8_t dist_lengths[30];
+        GetFixedLengths(litlen_lengths, dist_lengths);
+        std::copy(litlen_lengths, litlen_lengths + 286, litlen_bits);
+        std::copy(dist_lengths, dist_lengths + 30, dist_bits);
+    } else {
+        uint64_t litlen_total = 0;
+        uint64_t dist_total = 0;
+        for (uint32_t i = 0; i < 286; i++) {
+            litlen_total += stats->litlen[i];
+        }
+        for (uint32_t i = 0; i < 30; i++) {
+            dist_total += stats->dist[i];
+        }
+        double litlen_log = log2((double)litlen_total);
+        double dist_log = log2((double)std::max<uint64_t>(dist_total, 1));
+        for (uint32_t i = 0; i < 286; i++) {
+            litlen_bits[i] = litlen_log - (stats->litlen[i] != 0 ? log2((double)stats->litlen[i]) : 0);
+        }
+        for (uint32_t i = 0; i < 30; i++) {
+            dist_bits[i] = dist_log - (stats->dist[i] != 0 ? log2((double)stats->dist[i]) : 0);
+        }
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        costs.lit[i] = litlen_bits[i];
+    }
+    for (uint32_t len = 3; len <= DEFLATE_MAX_LEN; len++) {
+        uint32_t sym = GetLengthSymbol(len);
+        costs.len[len] = litlen_bits[257 + sym] + deflate_len_extra[sym];
+    }
+    for (uint32_t i = 0; i < 30; i++) {
+        costs.dist[i] = dist_bits[i] + deflate_dist_extra[i];
+    }
+}
+
+// Shortest-path parse of data under costs, like OptimalParse but trying
+// every distance listed for a position.
+static void ParseDeflate(const uint8_t *data, uint32_t size, const std::vector<uint32_t> &match_start,
+    const std::vector<DeflateMatch> &matches, const DeflateCosts &costs, std::vector<DeflateSymbol> &symbols)
+{
+    std::vector<double> cost(size + 1);
+    std::vector<DeflateSymbol> choice(size);
+    cost[size] = 0;
+    for (uint32_t pos = size; pos-- > 0;) {
+        DeflateSymbol best_symbol = { data[pos], 0 };
+        double best = costs.lit[data[pos]] + cost[pos + 1];
+        uint32_t len = 3;
+        for (uint32_t i = match_start[pos]; i < match_start[pos + 1]; i++) {
+            const DeflateMatch &match = matches[i];
+            double dist_cost = costs.dist[GetDistSymbol(match.dist)];
+            for (; len <= match.len; len++) {
+                double bits = costs.len[len] + dist_cost + cost[pos + len];
+                if (bits < best) {
+                    best = bits;
+                    best_symbol.litlen = len;
+                    best_symbol.dist = match.dist;
+                }
+            }
+        }
+        cost[pos] = best;
+        choice[pos] = best_symbol;
+    }
+    symbols.clear();
+    for (uint32_t pos = 0; pos < size; pos += choice[pos].dist != 0 ? choice[pos].litlen : 1) {
+        symbols.push_back(choice[pos]);
+    }
+}
+
+// Finds where splitting symbols from start to end in two saves the most,
+// narrowing in on it through rounds of evenly spaced tries. Returns 0 if no
+// split beats keeping one block.
+static uint32_t FindBlockSplit(DeflateStatsIndex &index, const std::vector<uint32_t> &raw_pos, uint32_t start,
+    uint32_t end)
+{
+    if (end - start <= DEFLATE_MIN_BLOCK * 2) {
+        return 0;
+    }
+    auto block_bits = [&index, &raw_pos](uint32_t block_start, uint32_t block_end) {
+        DeflateStats stats;
+        index.Get(block_start, block_end, stats);
+        return GetBlockBits(stats, raw_pos[block_end] - raw_pos[block_start]);
+    };
+    uint32_t low = start + DEFLATE_MIN_BLOCK;
+    uint32_t high = end - DEFLATE_MIN_BLOCK;
+    uint32_t best_split = 0;
+    uint64_t best = UINT64_MAX;
+    for (;;) {
+        uint32_t step = (high - low) / (DEFLATE_SPLIT_TRIES + 1);
+        if (step == 0) {
+            break;
+        }
+        uint32_t round_split = low;
+        uint64_t round_best = UINT64_MAX;
+        for (uint32_t i = 1; i <= DEFLATE_SPLIT_TRIES; i++) {
+            uint64_t bits = block_bits(start, low + step * i) + block_bits(low + step * i, end);
+            if (bits < round_best) {
+                round_best = bits;
+                round_split = low + step * i;
+            }
+        }
+        if (round_best < best) {
+            best = round_best;
+            best_split = round_split;
+        }
+        low = round_split - step;
+        high = round_split + step;
+    }
+    if (best >= block_bits(start, end)) {
+        return 0;
+    }
+    return best_split;
+}
+
+static void EncodeDeflateChunk(ByteSpan src, uint32_t start, uint32_t end, uint32_t iterations, DeflateChunk &chunk)
+{
+    std::vector<uint32_t> match_start;
+    std::vector<DeflateMatch> matches;
+    std::vector<DeflateSymbol> symbols;
+    DeflateCosts costs;
+    DeflateStats stats;
+    uint64_t best_bits = UINT64_MAX;
+    uint64_t last_bits = 0;
+    FindDeflateMatches(src, start, end, match_start, matches);
+    GetDeflateCosts(NULL, costs);
+    for (uint32_t i = 0; i < iterations; i++) {
+        ParseDeflate(&src.data[start], end - start, match_start, matches, costs, symbols);
+        CountSymbols(symbols.data(), symbols.size(), stats);
+        uint64_t bits = GetBlockBits(stats, end - start);
+        if (bits < best_bits) {
+            best_bits = bits;
+            chunk.symbols = symbols;
+        }
+        // the model has settled once a pass no longer changes the size
+        if (bits == last_bits) {
+            break;
+        }
+        last_bits = bits;
+        GetDeflateCosts(&stats, costs);
+    }
+    uint32_t count = chunk.symbols.size();
+    std::vector<uint32_t> raw_pos(count + 1);
+    raw_pos[0] = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const DeflateSymbol &symbol = chunk.symbols[i];
+        raw_pos[i + 1] = raw_pos[i] + (symbol.dist != 0 ? symbol.litlen : 1);
+    }
+    DeflateStatsIndex index;
+    index.Init(chunk.symbols.data(), count);
+    std::vector<std::pair<uint32_t, uint32_t>> pending(1, std::make_pair(0, count));
+    chunk.block_ends.clear();
+    while (!pending.empty()) {
+        std::pair<uint32_t, uint32_t> range = pending.back();
+        pending.pop_back();
+        uint32_t split = FindBlockSplit(index, raw_pos, range.first, range.second);
+        if (split == 0) {
+            chunk.block_ends.push_back(range.second);
+        } else {
+            pending.push_back(std::make_pair(range.first, split));
+            pending.push_back(std::make_pair(split, range.second));
+        }
+    }
+    std::sort(chunk.block_ends.begin(), chunk.block_ends.end());
+}
+
+// Same layout as CompressZlib: raw length, compressed length, zlib stream
+uint32_t CompressZlibOptimal(std::vector<uint8_t> &file_dst, ByteSpan src, const CompressOptions &options)
+{
+    uint32_t chunk_count = (src.size + DEFLATE_CHUNK_SIZE - 1) / DEFLATE_CHUNK_SIZE;
+    std::vector<DeflateChunk> chunks(chunk_count);
+    std::atomic<uint32_t> next_chunk(0);
+    auto encode = [&]() {
+        for (uint32_t i = next_chunk++; i < chunk_count; i = next_chunk++) {
+            uint32_t start = i * DEFLATE_CHUNK_SIZE;
+            uint32_t end = std::min<uint32_t>(start + DEFLATE_CHUNK_SIZE, src.size);
+            EncodeDeflateChunk(src, start, end, options.zlib_iterations, chunks[i]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < std::min(options.match_threads, chunk_count); i++) {
+        threads.push_back(std::thread(encode));
+    }
+    encode();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    BitWriter out;
+    uint32_t raw_ofs = 0;
+    if (chunk_count == 0) {
+        WriteDeflateBlock(out, NULL, 0, src.data, 0, true);
+    }
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        DeflateChunk &chunk = chunks[i];
+        uint32_t block_start = 0;
+        for (size_t j = 0; j < chunk.block_ends.size(); j++) {
+            uint32_t block_end = chunk.block_ends[j];
+            uint32_t raw_size = 0;
+            for (uint32_t k = block_start; k < block_end; k++) {
+                raw_size += chunk.symbols[k].dist != 0 ? chunk.symbols[k].litlen : 1;
+            }
+            bool last = i == chunk_count - 1 && j == chunk.block_ends.size() - 1;
+            WriteDeflateBlock(out, &chunk.symbols[block_start], block_end - block_start, &src.data[raw_ofs],
+                raw_size, last);
+            raw_ofs += raw_size;
+            block_start = block_end;
+        }
+        std::vector<DeflateSymbol>().swap(chunk.symbols);
+    }
+    size_t header_ofs = file_dst.size();
+    uint32_t output_size = 2 + out.data.size() + 4;
+    WriteU32(file_dst, src.size);
+    WriteU32(file_dst, output_size);
+    // deflate with a 32 KB window at the highest level, as zlib -9 writes
+    WriteU8(file_dst, 0x78);
+    WriteU8(file_dst, 0xDA);
+    WriteBytes(file_dst, out.data.data(), out.data.size());
+    WriteU32(file_dst, adler32(adler32(0, Z_NULL, 0), src.data, src.size));
+    return file_dst.size() - header_ofs;
+}
+
+// Copies len bytes from dist bytes back in dst. Overlapping copies repeat
+// the pattern, as the target's byte by byte decoders do.
+void CopyMatch(uint8_t *dst, uint32_t dist, uint32_t len)
+{
+    const uint8_t *from = dst - dist;
+    if (dist >= len) {
+        memcpy(dst, from, len);
+    } else {
+        for (uint32_t i = 0; i < len; i++) {
+            dst[i] = from[i];
+        }
+    }
+}
+
+// The decoders return false if src is truncated or refers outside of the
+// data decoded so far.
+bool DecompressLzss(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t raw_size)
+{
+    uint32_t src_pos = 0;
+    uint32_t dst_pos = 0;
+    uint32_t flags = 0;
+    while (dst_pos < raw_size) {
+        if ((flags & 0x100) == 0) {
+            if (src_pos >= src_size) {
+                return false;
+            }
+            flags = src[src_pos++] | 0xFF00;
+        }
+        if (flags & 1) {
+            if (src_pos >= src_size) {
+                return false;
+            }
+            dst[dst_pos++] = src[src_pos++];
+        } else {
+            if (src_pos + 2 > src_size) {
+                return false;
+            }
+            /* ring positions count from N - F at the first output byte,
+               and the ring starts out filled with zeros */
+            uint32_t ring_pos = src[src_pos] | ((src[src_pos + 1] & 0xC0) << 2);
+            uint32_t len = (src[src_pos + 1] & 0x3F) + THRESHOLD + 1;
+            uint32_t dist = (N - F + dst_pos - ring_pos) & (N - 1);
+            src_pos += 2;
+            if (dist == 0) {
+                dist = N;
+            }
+            if (len > raw_size - dst_pos) {
+                len = raw_size - dst_pos;
+            }
+            if (dist > dst_pos) {
+                uint32_t zero_len = std::min(len, dist - dst_pos);
+                memset(&dst[dst_pos], 0, zero_len);
+                dst_pos += zero_len;
+                len -= zero_len;
+            }
+            if (len > 0) {
+                CopyMatch(&dst[dst_pos], dist, len);
+                dst_pos += len;
+            }
+        }
+        flags >>= 1;
+    }
+    return true;
+}
+
+bool DecompressSlide(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t raw_size)
+{
+    uint32_t src_pos = 4;
+    uint32_t dst_pos = 0;
+    uint32_t flags = 0;
+    uint32_t flag_count = 0;
+    if (src_size < 4 || ReadU32(src) != raw_size) {
+        return false;
+    }
+    while (dst_pos < raw_size) {
+        if (flag_count == 0) {
+            if (src_pos + 4 > src_size) {
+                return false;
+            }
+            flags = ReadU32(&src[src_pos]);
+            src_pos += 4;
+            flag_count = 32;
+        }
+        if (flags & 0x80000000) {
+            if (src_pos >= src_size) {
+                return false;
+            }
+            dst[dst_pos++] = src[src_pos++];
+        } else {
+            if (src_pos + 2 > src_size) {
+                return false;
+            }
+            uint32_t dist = (((src[src_pos] & 0xF) << 8) | src[src_pos + 1]) + 1;
+            uint32_t len = src[src_pos] >> 4;
+            src_pos += 2;
+            if (len == 0) {
+                if (src_pos >= src_size) {
+                    return false;
+                }
+                len = src[src_pos++] + 0x12;
+            } else {
+                len += 2;
+            }
+            if (dist > dst_pos || len > raw_size - dst_pos) {
+                return false;
+            }
+            CopyMatch(&dst[dst_pos], dist, len);
+            dst_pos += len;
+        }
+        flags <<= 1;
+        flag_count--;
+    }
+    return true;
+}
+
+bool DecompressRle(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t raw_size)
+{
+    uint32_t src_pos = 0;
+    uint32_t dst_pos = 0;
+    while (dst_pos < raw_size) {
+        if (src_pos >= src_size) {
+            return false;
+        }
+        uint32_t code = src[src_pos++];
+        uint32_t len = code & 0x7F;
+        if (len > raw_size - dst_pos) {
+            return false;
+        }
+        if (code & 0x80) {
+            if (len > src_size - src_pos) {
+                return false;
+            }
+            // src may overlap dst when decoding in place
+            memmove(&dst[dst_pos], &src[src_pos], len);
+            src_pos += len;
+        } else {
+            if (src_pos >= src_size) {
+                return false;
+            }
+            memset(&dst[dst_pos], src[src_pos++], len);
+        }
+        dst_pos += len;
+    }
+    return true;
+}
+
+bool DecompressZlib(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t raw_size)
+{
+    if (src_size < 8 || ReadU32(src) != raw_size || ReadU32(&src[4]) > src_size - 8) {
+        return false;
+    }
+    uLongf dst_size = raw_size;
+    if (raw_size == 0) {
+        return true;
+    }
+    return uncompress(dst, &dst_size, &src[8], ReadU32(&src[4])) == Z_OK && dst_size == raw_size;
+}
+
+bool DecompressBuffer(const uint8_t *src, uint32_t src_size, uint32_t comp_type, uint8_t *dst, uint32_t raw_size)
+{
+    switch (comp_type) {
+        case COMP_TYPE_NONE:
+            if (raw_size > src_size) {
+                return false;
+            }
+            memmove(dst, src, raw_size);
+            return true;
+
+        case COMP_TYPE_LZSS:
+            return DecompressLzss(src, src_size, dst, raw_size);
+
+        case COMP_TYPE_SLIDE:
+            return DecompressSlide(src, src_size, dst, raw_size);
+
+        case COMP_TYPE_RLE:
+            return DecompressRle(src, src_size, dst, raw_size);
+
+        case COMP_TYPE_ZLIB:
+            return DecompressZlib(src, src_size, dst, raw_size);
+
+        default:
+            return false;
+    }
+}
+
+// The margin functions walk a stream like its decoder, recording the
+// furthest the output gets ahead of the input read so far. Each match or
+// run is written only after its code is read, so checking at its end
+// covers every byte of it.
+bool GetLzssLead(ByteSpan src, uint32_t raw_size, int64_t *lead)
+{
+    uint32_t src_pos = 0;
+    uint32_t dst_pos = 0;
+    uint32_t flags = 0;
+    while (dst_pos < raw_size) {
+        if ((flags & 0x100) == 0) {
+            if (src_pos >= src.size) {
+                return false;
+            }
+            flags = src.data[src_pos++] | 0xFF00;
+        }
+        if (flags & 1) {
+            if (src_pos >= src.size) {
+                return false;
+            }
+            src_pos++;
+            dst_pos++;
+        } else {
+            if (src_pos + 2 > src.size) {
+                return false;
+            }
+            uint32_t len = (src.data[src_pos + 1] & 0x3F) + THRESHOLD + 1;
+            src_pos += 2;
+            dst_pos += std::min(len, raw_size - dst_pos);
+        }
+        *lead = std::max<int64_t>(*lead, (int64_t)dst_pos - src_pos);
+        flags >>= 1;
+    }
+    return true;
+}
+
+bool GetSlideLead(ByteSpan src, uint32_t raw_size, int64_t *lead)
+{
+    uint32_t src_pos = 4;
+    uint32_t dst_pos = 0;
+    uint32_t flags = 0;
+    uint32_t flag_count = 0;
+    if (src.size < 4 || ReadU32(src.data) != raw_size) {
+        return false;
+    }
+    while (dst_pos < raw_size) {
+        if (flag_count == 0) {
+            if (src_pos + 4 > src.size) {
+                return false;
+            }
+            flags = ReadU32(&src.data[src_pos]);
+            src_pos += 4;
+            flag_count = 32;
+        }
+        if (flags & 0x80000000) {
+            if (src_pos >= src.size) {
+                return false;
+            }
+            src_pos++;
+            dst_pos++;
+        } else {
+            if (src_pos + 2 > src.size) {
+                return false;
+            }
+            uint32_t len = src.data[src_pos] >> 4;
+            src_pos += 2;
+            if (len == 0) {
+                if (src_pos >= src.size) {
+                    return false;
+                }
+                len = src.data[src_pos++] + 0x12;
+            } else {
+                len += 2;
+            }
+            if (len > raw_size - dst_pos) {
+                return false;
+            }
+            dst_pos += len;
+        }
+        *lead = std::max<int64_t>(*lead, (int64_t)dst_pos - src_pos);
+        flags <<= 1;
+        flag_count--;
+    }
+    return true;
+}
+
+bool GetRleLead(ByteSpan src, uint32_t raw_size, int64_t *lead)
+{
+    uint32_t src_pos = 0;
+    uint32_t dst_pos = 0;
+    while (dst_pos < raw_size) {
+        if (src_pos >= src.size) {
+            return false;
+        }
+        uint32_t code = src.data[src_pos++];
+        uint32_t len = code & 0x7F;
+        // literal bytes are each read before they are written
+        uint32_t src_len = (code & 0x80) ? len : 1;
+        if (len > raw_size - dst_pos || src_len > src.size - src_pos) {
+            return false;
+        }
+        src_pos += src_len;
+        dst_pos += len;
+        *lead = std::max<int64_t>(*lead, (int64_t)dst_pos - src_pos);
+    }
+    return true;
+}
+
+// Feeds inflate one byte at a time, so that everything it has written
+// after each call depends only on the input read up to that byte.
+bool GetZlibLead(ByteSpan src, uint32_t raw_size, int64_t *lead)
+{
+    if (src.size < 8 || ReadU32(src.data) != raw_size || ReadU32(&src.data[4]) > src.size - 8) {
+        return false;
+    }
+    if (raw_size == 0) {
+        return true;
+    }
+    std::vector<uint8_t> out(raw_size);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        return false;
+    }
+    uint32_t stream_size = ReadU32(&src.data[4]);
+    int ret = Z_OK;
+    stream.next_out = out.data();
+    stream.avail_out = raw_size;
+    for (uint32_t i = 0; i < stream_size && ret == Z_OK; i++) {
+        stream.next_in = const_cast<uint8_t *>(&src.data[8 + i]);
+        stream.avail_in = 1;
+        ret = inflate(&stream, Z_NO_FLUSH);
+        *lead = std::max<int64_t>(*lead, (int64_t)stream.total_out - (8 + i + 1));
+    }
+    inflateEnd(&stream);
+    return ret == Z_STREAM_END && stream.total_out == raw_size;
+}
+
+bool GetInPlaceMargin(ByteSpan src, uint32_t comp_type, uint32_t raw_size, uint32_t *margin)
+{
+    int64_t lead = 0;
+    bool valid;
+    switch (comp_type) {
+        case COMP_TYPE_NONE:
+            // copied byte by byte onto itself
+            valid = src.size >= raw_size;
+            break;
+
+        case COMP_TYPE_LZSS:
+            valid = GetLzssLead(src, raw_size, &lead);
+            break;
+
+        case COMP_TYPE_SLIDE:
+            valid = GetSlideLead(src, raw_size, &lead);
+            break;
+
+        case COMP_TYPE_RLE:
+            valid = GetRleLead(src, raw_size, &lead);
+            break;
+
+        case COMP_TYPE_ZLIB:
+            valid = GetZlibLead(src, raw_size, &lead);
+            break;
+
+        default:
+            return false;
+    }
+    // with the input ending where the buffer does, output byte dst_pos
+    // overlaps input byte dst_pos - (raw_size + margin - src.size)
+    *margin = (uint32_t)std::max<int64_t>(0, lead + src.size - raw_size);
+    return valid;
+}
+
+uint32_t GetDecodeScratch(ByteSpan src, uint32_t comp_type)
+{
+    switch (comp_type) {
+        case COMP_TYPE_LZSS:
+            return N;
+
+        case COMP_TYPE_ZLIB:
+            // zconf.h: inflate needs 1 << windowBits plus about 7 KB
+            if (src.size > 8) {
+                return (1 << ((src.data[8] >> 4) + 8)) + 7 * 1024;
+            }
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+std::string comp_type_names[COMP_TYPE_COUNT] = { "none", "lzss", "slide", "rle", "zlib" };
+uint32_t comp_type_values[COMP_TYPE_COUNT] = { COMP_TYPE_NONE, COMP_TYPE_LZSS, COMP_TYPE_SLIDE, COMP_TYPE_RLE, COMP_TYPE_ZLIB };
+
+uint32_t GetCompTypeValue(std::string type)
+{
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    if (type == "auto") {
+        return COMP_TYPE_AUTO;
+    }
+    for (uint32_t i = 0; i < COMP_TYPE_COUNT; i++) {
+        if (comp_type_names[i] == type) {
+            return comp_type_values[i];
+        }
+    }
+    return COMP_TYPE_NONE;
+}
+
+std::string GetCompTypeName(uint32_t value)
+{
+    for (uint32_t i = 0; i < COMP_TYPE_COUNT; i++) {
+        if (comp_type_values[i] == value) {
+            return comp_type_names[i];
+        }
+    }
+    return std::to_string(value);
+}
+
+uint32_t CompressBuffer(ByteSpan src, uint32_t comp_type, std::vector<uint8_t> &data,
+    const CompressOptions &options)
+{
+    data.clear();
+    switch (comp_type) {
+        case COMP_TYPE_LZSS:
+            return CompressLzss(data, src, options);
+
+        case COMP_TYPE_SLIDE:
+            return CompressSlide(data, src, options);
+
+        case COMP_TYPE_RLE:
+            return CompressRle(data, src);
+
+        case COMP_TYPE_ZLIB:
+            if (options.zlib_iterations != 0) {
+                return CompressZlibOptimal(data, src, options);
+            }
+            return CompressZlib(data, src);
+
+        default:
+            WriteBytes(data, src.data, src.size);
+            return src.size;
+    }
+}
+
+bool CompressStream(const StreamReader &read, uint32_t size, uint32_t comp_type, const StreamSink &sink,
+    const CompressOptions &options, uint32_t *comp_size)
+{
+    StreamWindow in;
+    CompressOptions stream_options = options;
+    // the reference slide parse measures matches to the end of the input and
+    // the optimal parses plan over all of it, neither of which fits a window
+    stream_options.match_mode = MATCH_FAST;
+    stream_options.optimal_parse = false;
+    switch (comp_type) {
+        case COMP_TYPE_LZSS:
+            in.Init(read, size, 0, F);
+            *comp_size = CompressLzssWindow(in, sink);
+            break;
+
+        case COMP_TYPE_SLIDE:
+            // nintendoEnc also searches one byte past the token it encodes
+            in.Init(read, size, SLIDE_WINDOW, SLIDE_MAX_LEN + 2);
+            *comp_size = CompressSlideWindow(in, sink, stream_options);
+            break;
+
+        case COMP_TYPE_RLE:
+            in.Init(read, size, 0, 128);
+            *comp_size = CompressRleWindow(in, sink);
+            break;
+
+        case COMP_TYPE_ZLIB:
+            return CompressZlibStream(read, size, sink, comp_size);
+
+        default:
+            in.Init(read, size, 0, 1);
+            for (uint32_t pos = 0; pos < size; pos = in.end) {
+                in.Fill(pos);
+                sink.write(in.At(pos), in.end - pos);
+            }
+            *comp_size = size;
+            break;
+    }
+    return !in.failed;
+}
+
+uint32_t GetDecodeCost(uint32_t comp_type)
+{
+    switch (comp_type) {
+        case COMP_TYPE_NONE:
+            return 0;
+
+        case COMP_TYPE_RLE:
+            return 1;
+
+        case COMP_TYPE_LZSS:
+        case COMP_TYPE_SLIDE:
+            return 2;
+
+        default:
+            return 3;
+    }
+}
+
+// Deflates a few blocks spread over the file at the fastest level. If they
+// barely shrink, the full encoders are not going to do better.
+bool IsIncompressible(ByteSpan src)
+{
+    const uint32_t block_size = 4096;
+    const uint32_t block_count = 8;
+    uint8_t packed[block_size + 64];
+    uint32_t sample_size = 0;
+    uint32_t packed_size = 0;
+    if (src.size < block_size * block_count) {
+        return false;
+    }
+    for (uint32_t i = 0; i < block_count; i++) {
+        uLongf size = sizeof(packed);
+        uint32_t block_ofs = (uint32_t)(((uint64_t)(src.size - block_size) * i) / (block_count - 1));
+        if (compress2(packed, &size, &src.data[block_ofs], block_size, Z_BEST_SPEED) != Z_OK) {
+            break;
+        }
+        sample_size += block_size;
+        packed_size += size;
+    }
+    return sample_size != 0 && packed_size >= sample_size - (sample_size / 50);
+}
+
+uint32_t CompressAuto(ByteSpan src, std::vector<uint8_t> &data, uint32_t *comp_type,
+    const CompressOptions &options, const CompressFunc &compress)
+{
+    std::vector<uint8_t> trial;
+    uint32_t types[COMP_TYPE_COUNT];
+    CompressFunc compress_type = compress;
+    if (!compress_type) {
+        compress_type = [&options](ByteSpan src, uint32_t comp_type, std::vector<uint8_t> &data) {
+            return CompressBuffer(src, comp_type, data, options);
+        };
+    }
+    std::copy(comp_type_values, comp_type_values + COMP_TYPE_COUNT, types);
+    std::stable_sort(types, types + COMP_TYPE_COUNT, [](uint32_t a, uint32_t b) {
+        return GetDecodeCost(a) < GetDecodeCost(b);
+    });
+    bool incompressible = IsIncompressible(src);
+    uint32_t comp_size = compress_type(src, COMP_TYPE_NONE, data);
+    *comp_type = COMP_TYPE_NONE;
+    for (uint32_t i = 0; i < COMP_TYPE_COUNT && !incompressible; i++) {
+        if (types[i] == COMP_TYPE_NONE || GetDecodeCost(types[i]) > options.max_decode_cost) {
+            continue;
+        }
+        uint32_t size = compress_type(src, types[i], trial);
+        uint32_t margin;
+        if (size < comp_size && (options.inplace_budget == 0xFFFFFFFF
+            || (GetInPlaceMargin({ trial.data(), size }, types[i], src.size, &margin)
+            && margin <= options.inplace_budget))) {
+            *comp_type = types[i];
+            comp_size = size;
+            data.swap(trial);
+        }
+    }
+    return comp_size;
+}
+
+#define ESTIMATE_BLOCK_SIZE 0x4000
+// Samples taken: one per ESTIMATE_SPACING bytes of input, within these
+#define ESTIMATE_MIN_SAMPLES 8
+#define ESTIMATE_MAX_SAMPLES 64
+#define ESTIMATE_SPACING 0x80000
+
+static void EstimateType(ByteSpan src, uint32_t comp_type, const CompressOptions &options, SizeEstimate *estimate)
+{
+    std::vector<uint8_t> data;
+    estimate->comp_type = comp_type;
+    if (comp_type == COMP_TYPE_NONE || src.size <= ESTIMATE_BLOCK_SIZE * ESTIMATE_MIN_SAMPLES) {
+        uint32_t size = comp_type == COMP_TYPE_NONE ? src.size : CompressBuffer(src, comp_type, data, options);
+        estimate->size = estimate->low = estimate->high = size;
+        estimate->exact = true;
+        return;
+    }
+    // A block compressed alone pays for starting without history. What a
+    // second block adds after it is what a block costs in the middle of the
+    // input, so only the input's own first block is counted cold.
+    const uint32_t block_size = ESTIMATE_BLOCK_SIZE;
+    uint32_t sample_count = std::min(std::max(src.size / ESTIMATE_SPACING, (uint32_t)ESTIMATE_MIN_SAMPLES),
+        (uint32_t)ESTIMATE_MAX_SAMPLES);
+    uint32_t first_size = 0;
+    double ratios[ESTIMATE_MAX_SAMPLES];
+    double mean = 0;
+    for (uint32_t i = 0; i < sample_count; i++) {
+        uint32_t block_ofs = (uint32_t)(((uint64_t)(src.size - block_size * 2) * i) / (sample_count - 1));
+        uint32_t size = CompressBuffer({ &src.data[block_ofs], block_size }, comp_type, data, options);
+        uint32_t pair_size = CompressBuffer({ &src.data[block_ofs], block_size * 2 }, comp_type, data, options);
+        if (i == 0) {
+            first_size = size;
+        }
+        ratios[i] = ((double)pair_size - size) / block_size;
+        mean += ratios[i] / sample_count;
+    }
+    double variance = 0;
+    for (uint32_t i = 0; i < sample_count; i++) {
+        variance += (ratios[i] - mean) * (ratios[i] - mean) / (sample_count - 1);
+    }
+    // Student's t for a 95% interval, within 1% for these sample counts
+    double t = 1.96 + 2.8 / (sample_count - 1);
+    // the samples cover part of a finite input, which narrows the interval
+    double rest = src.size - block_size;
+    double block_total = rest / block_size;
+    double error = t * sqrt(variance / sample_count * std::max(block_total - sample_count, 0.0) / (block_total - 1));
+    double size = first_size + std::max(mean, 0.0) * rest;
+    double low = first_size + std::max(mean - error, 0.0) * rest;
+    double high = first_size + (mean + error) * rest;
+    estimate->size = (uint32_t)std::min(size + 0.5, 4294967295.0);
+    estimate->low = (uint32_t)std::min(low, 4294967295.0);
+    estimate->high = (uint32_t)std::min(high + 1, 4294967295.0);
+    estimate->exact = false;
+}
+
+void EstimateCompressedSize(ByteSpan src, uint32_t comp_type, const CompressOptions &options,
+    SizeEstimate *estimate)
+{
+    if (comp_type != COMP_TYPE_AUTO) {
+        EstimateType(src, comp_type, options, estimate);
+        return;
+    }
+    // Tried in the order CompressAuto tries them, keeping the first of the
+    // smallest. It keeps the smallest actual size, which is no larger than
+    // any format's upper bound and no smaller than the lowest lower bound.
+    uint32_t types[COMP_TYPE_COUNT];
+    std::copy(comp_type_values, comp_type_values + COMP_TYPE_COUNT, types);
+    std::stable_sort(types, types + COMP_TYPE_COUNT, [](uint32_t a, uint32_t b) {
+        return GetDecodeCost(a) < GetDecodeCost(b);
+    });
+    EstimateType(src, COMP_TYPE_NONE, options, estimate);
+    if (IsIncompressible(src)) {
+        return;
+    }
+    for (uint32_t i = 0; i < COMP_TYPE_COUNT; i++) {
+        if (types[i] == COMP_TYPE_NONE || GetDecodeCost(types[i]) > options.max_decode_cost) {
+            continue;
+        }
+        SizeEstimate trial;
+        EstimateType(src, types[i], options, &trial);
+        if (trial.size < estimate->size) {
+            estimate->comp_type = trial.comp_type;
+            estimate->size = trial.size;
+        }
+        estimate->low = std::min(estimate->low, trial.low);
+        estimate->high = std::min(estimate->high, trial.high);
+        estimate->exact &= trial.exact;
+    }
+}
@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include "mpbinpack.h"
+
+// Byte comparison kernels for the encoders' inner loops. Every version
+// returns exactly what the scalar one does, so the level only changes
+// speed. The vector versions read whole blocks, past the first mismatch
+// where the scalar loop stops, but never outside [0, max_len), plus
+// data[max_len] for FindEqualPair; callers keep that range valid.
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || \
+    (defined(__i386__) && defined(__SSE2__))
+#define KERNEL_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC compiles AVX2 intrinsics anywhere; GCC and Clang only in functions
+// marked for it, which are then only called once cpuid says they can run.
+#if defined(KERNEL_X86) && !defined(_MSC_VER)
+#define KERNEL_AVX2_FUNC __attribute__((target("avx2")))
+#else
+#define KERNEL_AVX2_FUNC
+#endif
+
+#ifdef KERNEL_X86
+static uint32_t CountTrailingZeros(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static KernelLevel DetectKernelLevel()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7) {
+        __cpuid(info, 1);
+        // AVX2 also needs the OS to save the ymm registers
+        bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        if (os_avx && (info[1] & (1 << 5))) {
+            return KERNEL_AVX2;
+        }
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return KERNEL_AVX2;
+    }
+#endif
+    return KERNEL_SSE2;
+}
+#else
+static KernelLevel DetectKernelLevel()
+{
+    return KERNEL_SCALAR;
+}
+#endif
+
+static KernelLevel supported_level = DetectKernelLevel();
+static KernelLevel kernel_level = supported_level;
+
+static uint32_t MatchPrefixScalar(const uint8_t *a, const uint8_t *b, uint32_t max_len)
+{
+    uint32_t len = 0;
+    while (len < max_len && a[len] == b[len]) {
+        len++;
+    }
+    return len;
+}
+
+static uint32_t FindEqualPairScalar(const uint8_t *data, uint32_t max_len)
+{
+    uint32_t len = 0;
+    while (len < max_len && data[len] != data[len + 1]) {
+        len++;
+    }
+    return len;
+}
+
+#ifdef KERNEL_X86
+static uint32_t MatchPrefixSse2(const uint8_t *a, const uint8_t *b, uint32_t max_len)
+{
+    uint32_t len = 0;
+    while (len + 16 <= max_len) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + len));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + len));
+        uint32_t differ = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+        if (differ != 0) {
+            return len + CountTrailingZeros(differ);
+        }
+        len += 16;
+    }
+    return len + MatchPrefixScalar(a + len, b + len, max_len - len);
+}
+
+static uint32_t FindEqualPairSse2(const uint8_t *data, uint32_t max_len)
+{
+    uint32_t len = 0;
+    while (len + 16 <= max_len) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + len));
+        __m128i y = _mm_loadu_si128((const __m128i *)(data + len + 1));
+        uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (equal != 0) {
+            return len + CountTrailingZeros(equal);
+        }
+        len += 16;
+    }
+    return len + FindEqualPairScalar(data + len, max_len - len);
+}
+
+KERNEL_AVX2_FUNC static uint32_t MatchPrefixAvx2(const uint8_t *a, const uint8_t *b, uint32_t max_len)
+{
+    uint32_t len = 0;
+    while (len + 32 <= max_len) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + len));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + len));
+        uint32_t differ = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (differ != 0) {
+            return len + CountTrailingZeros(differ);
+        }
+        len += 32;
+    }
+    return len + MatchPrefixSse2(a + len, b + len, max_len - len);
+}
+
+KERNEL_AVX2_FUNC static uint32_t FindEqualPairAvx2(const uint8_t *data, uint32_t max_len)
+{
+    uint32_t len = 0;
+    while (len + 32 <= max_len) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + len));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(data + len + 1));
+        uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (equal != 0) {
+            return len + CountTrailingZeros(equal);
+        }
+        len += 32;
+    }
+    return len + FindEqualPairSse2(data + len, max_len - len);
+}
+#endif
+
+KernelLevel GetKernelLevel()
+{
+    return kernel_level;
+}
+
+KernelLevel SetKernelLevel(KernelLevel level)
+{
+    kernel_level = level < supported_level ? level : supported_level;
+    return kernel_level;
+}
+
+const char *GetKernelLevelName(KernelLevel level)
+{
+    switch (level) {
+        case KERNEL_SSE2:
+            return "sse2";
+        case KERNEL_AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+uint32_t MatchPrefix(const uint8_t *a, const uint8_t *b, uint32_t max_len)
+{
+#ifdef KERNEL_X86
+    if (kernel_level == KERNEL_AVX2) {
+        return MatchPrefixAvx2(a, b, max_len);
+    }
+    if (kernel_level == KERNEL_SSE2) {
+        return MatchPrefixSse2(a, b, max_len);
+    }
+#endif
+    return MatchPrefixScalar(a, b, max_len);
+}
+
+uint32_t FindEqualPair(const uint8_t *data, uint32_t max_len)
+{
+#ifdef KERNEL_X86
+    if (kernel_level == KERNEL_AVX2) {
+        return FindEqualPairAvx2(data, max_len);
+    }
+    if (kernel_level == KERNEL_SSE2) {
+        return FindEqualPairSse2(data, max_len);
+    }
+#endif
+    return FindEqualPairScalar(data, max_len);
+}
@@ -1,20 +1,158 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <math.h>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <cctype>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <chrono>
+#include <limits>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 #include "external/tinyxml2/tinyxml2.h"
 #include "external/zlib/zlib.h"
+#include "mpbinpack.h"
 
 std::string xml_path;
 std::string bin_path;
 std::string header_path;
+uint32_t thread_count = 1;
+uint32_t io_thread_count = 2;
+uint32_t queue_depth = 0; // 0 for four entries per compress thread
+
+CompressOptions compress_options;
+std::string cache_dir;
+bool dedupe = false;
+bool unpack_mode = false;
+bool verify = false;
+uint32_t stream_min = 0;
+bool bench_mode = false;
+std::string bench_format = "json";
+uint32_t entry_align = 0; // 0 when not set on the command line
+uint32_t entry_payload_align = 0;
+bool header_inplace = false;
+bool update_mode = false;
+bool compact_mode = false;
+bool stats_mode = false;
+std::string trace_path;
+bool batch_mode = false;
+std::vector<std::string> batch_paths;
+bool depfile = false;
+bool watch_mode = false;
+uint32_t debounce_ms = 200;
+bool estimate_mode = false;
+uint32_t budget = 0;
+bool refine = false;
 
 void PrintUsage(char *prog_name)
 {
-    printf("Usage: %s xml_file [-o bin_path] [-h header_path]\n", prog_name);
+    printf("Usage: %s xml_file [-o bin_path] [-h header_path] [-j threads] [options]\n", prog_name);
+    printf("       %s bin_file --unpack [-o out_dir]\n", prog_name);
+    printf("       %s bench [corpus_dir] [-o report_path] [--format json|csv] [options]\n", prog_name);
+    printf("       %s batch xml_file... [@list_file] [-o out_dir] [-h header_dir] [-j threads] [options]\n",
+        prog_name);
+    printf("Options:\n");
+    printf("  -h header_path\n");
+    printf("            Write a C header with an index, sizes and compression type for\n");
+    printf("            every entry id, and a hash table looking ids up\n");
+    printf("  --header-inplace\n");
+    printf("            Add in-place decode margins and decoder scratch sizes to the header\n");
+    printf("  --fast    Use faster slide matching (output differs from the reference encoder)\n");
+    printf("  --optimal Parse lzss and slide entries for the smallest output\n");
+    printf("  --zlib-iterations passes\n");
+    printf("            Write zlib entries with the built-in deflate encoder, which refines\n");
+    printf("            its parse for up to this many passes (15 is a good start) and beats\n");
+    printf("            zlib -9 at a much higher cost. Entries compressed while streaming\n");
+    printf("            still use zlib (default 0, always zlib)\n");
+    printf("  --io-threads threads\n");
+    printf("            Read sources ahead of compression on this many threads (default 2)\n");
+    printf("  --queue-depth entries\n");
+    printf("            Read at most this many entries ahead of the last one written,\n");
+    printf("            capping the memory held (default 4 per -j thread)\n");
+    printf("  --match-threads threads\n");
+    printf("            Search for --optimal and --zlib-iterations matches in large entries\n");
+    printf("            on several threads, 0 for one per hardware thread (default 1)\n");
+    printf("  --stream-min size\n");
+    printf("            Compress entries of at least size bytes while reading them, keeping\n");
+    printf("            only the format's window in memory. These skip the cache, and\n");
+    printf("            slide entries use --fast matching without --optimal\n");
+    printf("  --align size\n");
+    printf("            Start every entry on a size byte boundary, such as 2048 for disc\n");
+    printf("            sectors. Overrides the manifest's align attribute (default 1)\n");
+    printf("  --payload-align size\n");
+    printf("            Start every entry's data, after its 8 byte header, on a size byte\n");
+    printf("            boundary. Overrides the manifest's payload_align attribute\n");
+    printf("  --inplace-budget size\n");
+    printf("            Keep every entry decodable in place, from the end of a buffer at\n");
+    printf("            most size bytes larger than its output. Entries that would need\n");
+    printf("            more are stored uncompressed. Turns off --stream-min\n");
+    printf("  --cache-dir dir\n");
+    printf("            Reuse compressed entries stored in dir by earlier runs\n");
+    printf("  --dedupe  Store entries with identical contents and compression once\n");
+    printf("  --verify  Decompress every entry after packing and compare it to its source\n");
+    printf("  --max-decode-cost cost\n");
+    printf("            Limit compress_type=\"auto\" to formats no slower to decode than\n");
+    printf("            cost: 0 none, 1 rle, 2 lzss or slide, 3 zlib (default)\n");
+    printf("  --stats json\n");
+    printf("            Print sizes and timings for every stage and entry as JSON\n");
+    printf("  --trace trace_path\n");
+    printf("            Write a Chrome trace of the run, viewable in Perfetto\n");
+    printf("  --update  Recompress only the entries whose source, compress_type or alignment\n");
+    printf("            changed since the last --update, rewriting them inside the existing\n");
+    printf("            archive. A new write order or option packs from scratch. Source\n");
+    printf("            hashes are kept in bin_path.hashes. Turns off --stream-min\n");
+    printf("  --compact Same as --update, then rewrite the archive without the space left\n");
+    printf("            by entries that moved\n");
+    printf("  --unpack  Extract bin_file and write a manifest that packs it again\n");
+    printf("  --depfile Write bin_path.d, a Makefile rule listing the manifest and every\n");
+    printf("            source the archive depends on, which ninja reads as well\n");
+    printf("  --watch   After packing, keep running and pack again whenever sources change,\n");
+    printf("            compressing only the changed entries. Turns off --stream-min\n");
+    printf("  --debounce ms\n");
+    printf("            Have --watch wait until no source has changed for ms (default 200)\n");
+    printf("  --estimate\n");
+    printf("            Predict every entry's compressed size and the archive's from a few\n");
+    printf("            sampled blocks, with 95%% bounds, without writing anything. Entries of\n");
+    printf("            up to 128 KB are compressed whole. Ignores --inplace-budget\n");
+    printf("  --budget size\n");
+    printf("            Have --estimate exit with 1 if the archive is over size bytes\n");
+    printf("  --refine  Have --estimate compress the entries with the widest bounds whole\n");
+    printf("            until the archive is certain to be over or under --budget\n");
+    printf("  --format format\n");
+    printf("            Write the bench report as json (default) or csv\n");
+    printf("  --kernels level\n");
+    printf("            Compare bytes with scalar, sse2 or avx2 code, capped to what the\n");
+    printf("            CPU supports (default the best it supports). Output is the same\n");
+    printf("A manifest lists <file path=... compress_type=...> elements, and\n");
+    printf("<dir path=... pattern=... compress_type=...> elements adding every file\n");
+    printf("directly inside path whose name matches pattern, with * and ? as wildcards\n");
+    printf("(default *), in name order and with path/name as id. Both take align,\n");
+    printf("payload_align, order and group.\n");
+    printf("Batch packs many manifests in one run, sharing -j threads between them. The\n");
+    printf("archives are written one after another, and --queue-depth counts entries\n");
+    printf("across them; the largest entries within it are started first. Each source is\n");
+    printf("read by the thread compressing it, so --io-threads only sets the threads that\n");
+    printf("look up sources while manifests are read. A list file names one manifest per\n");
+    printf("line. Each archive and header is written beside its manifest, or in out_dir\n");
+    printf("and header_dir, named after it. It does not take --update, --compact,\n");
+    printf("--stats, --watch or --estimate.\n");
     exit(1);
 }
 
@@ -27,16 +165,149 @@ void PrintError(const char *fmt, ...)
     va_end(args);
 }
 
+// Parses a thread count, where 0 means one per hardware thread.
+uint32_t GetThreadCount(const char *value)
+{
+    uint32_t count = strtoul(value, NULL, 0);
+    if (count == 0) {
+        count = std::thread::hardware_concurrency();
+        if (count == 0) {
+            count = 1;
+        }
+    }
+    return count;
+}
+
+// Options taking a value accept both --name=value and --name value.
+const char *value_option_names[] = { "cache-dir", "max-decode-cost", "format", "match-threads", "stream-min",
+    "stats", "trace", "align", "payload-align",
+    "inplace-budget", "io-threads", "queue-depth", "kernels",
+    "debounce", "zlib-iterations", "budget" };
+
+int ParseLongOption(int argc, char **argv, int i)
+{
+    std::string name = &argv[i][2];
+    std::string value;
+    size_t value_ofs = name.find('=');
+    if (value_ofs != std::string::npos) {
+        value = name.substr(value_ofs + 1);
+        name = name.substr(0, value_ofs);
+    } else if (std::find(std::begin(value_option_names), std::end(value_option_names), name)
+        != std::end(value_option_names)) {
+        if (++i == argc) {
+            PrintUsage(argv[0]);
+        }
+        value = argv[i];
+    }
+    if (name == "fast") {
+        compress_options.match_mode = MATCH_FAST;
+    } else if (name == "optimal") {
+        compress_options.optimal_parse = true;
+    } else if (name == "header-inplace") {
+        header_inplace = true;
+    } else if (name == "update") {
+        update_mode = true;
+    } else if (name == "compact") {
+        update_mode = true;
+        compact_mode = true;
+    } else if (name == "dedupe") {
+        dedupe = true;
+    } else if (name == "verify") {
+        verify = true;
+    } else if (name == "unpack") {
+        unpack_mode = true;
+    } else if (name == "depfile") {
+        depfile = true;
+    } else if (name == "watch") {
+        watch_mode = true;
+    } else if (name == "estimate") {
+        estimate_mode = true;
+    } else if (name == "budget") {
+        budget = strtoul(value.c_str(), NULL, 0);
+    } else if (name == "refine") {
+        refine = true;
+    } else if (name == "debounce") {
+        debounce_ms = strtoul(value.c_str(), NULL, 0);
+    } else if (name == "max-decode-cost") {
+        compress_options.max_decode_cost = strtoul(value.c_str(), NULL, 0);
+    } else if (name == "zlib-iterations") {
+        compress_options.zlib_iterations = strtoul(value.c_str(), NULL, 0);
+    } else if (name == "match-threads") {
+        compress_options.match_threads = GetThreadCount(value.c_str());
+    } else if (name == "io-threads") {
+        io_thread_count = GetThreadCount(value.c_str());
+    } else if (name == "queue-depth") {
+        queue_depth = std::max<uint32_t>(strtoul(value.c_str(), NULL, 0), 1);
+    } else if (name == "stream-min") {
+        stream_min = strtoul(value.c_str(), NULL, 0);
+    } else if (name == "align") {
+        entry_align = std::max<uint32_t>(strtoul(value.c_str(), NULL, 0), 1);
+    } else if (name == "payload-align") {
+        entry_payload_align = std::max<uint32_t>(strtoul(value.c_str(), NULL, 0), 1);
+    } else if (name == "inplace-budget") {
+        compress_options.inplace_budget = strtoul(value.c_str(), NULL, 0);
+    } else if (name == "cache-dir") {
+        cache_dir = value;
+    } else if (name == "stats" && value == "json") {
+        stats_mode = true;
+    } else if (name == "trace") {
+        trace_path = value;
+    } else if (name == "format" && (value == "json" || value == "csv")) {
+        bench_format = value;
+    } else if (name == "kernels" && (value == "scalar" || value == "sse2" || value == "avx2")) {
+        SetKernelLevel(value == "avx2" ? KERNEL_AVX2 : value == "sse2" ? KERNEL_SSE2 : KERNEL_SCALAR);
+    } else {
+        PrintUsage(argv[0]);
+    }
+    return i;
+}
+
+// Adds the manifests named in a batch list file, one per line. Blank lines
+// and lines starting with # are skipped.
+void ReadListFile(const std::string &path)
+{
+    std::vector<uint8_t> text;
+    if (!ReadWholeFile(path, text)) {
+        PrintError("Failed to Open %s for Reading.\n", path.c_str());
+    }
+    std::string line;
+    text.push_back('\n');
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] != '\n') {
+            line += text[i];
+            continue;
+        }
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start != std::string::npos && line[start] != '#') {
+            batch_paths.push_back(line.substr(start, line.find_last_not_of(" \t\r") + 1 - start));
+        }
+        line.clear();
+    }
+}
+
 void ParseOptions(int argc, char **argv)
 {
     if (argc == 1) {
         PrintUsage(argv[0]);
     }
     xml_path = argv[1];
-    bin_path = xml_path.substr(0, xml_path.find_last_of('.'))+".bin";
+    bin_path = "";
     header_path = "";
+    if (xml_path == "bench") {
+        bench_mode = true;
+        xml_path = "";
+    } else if (xml_path == "batch") {
+        batch_mode = true;
+        xml_path = "";
+    }
     for (int i = 2; i < argc; i++) {
-        if (argv[i][0] == '-') {
+        if (bench_mode && argv[i][0] != '-' && xml_path.empty()) {
+            xml_path = argv[i];
+        } else if (batch_mode && argv[i][0] == '@') {
+            ReadListFile(argv[i] + 1);
+        } else if (batch_mode && argv[i][0] != '-') {
+            batch_paths.push_back(argv[i]);
+        } else if (argv[i][0] == '-') {
             switch (argv[i][1]) {
                 case 'o':
                     if (++i == argc) {
@@ -52,12 +323,32 @@ void ParseOptions(int argc, char **argv)
                     header_path = argv[i];
                     break;
 
+                case 'j':
+                    if (++i == argc) {
+                        PrintUsage(argv[0]);
+                    }
+                    thread_count = GetThreadCount(argv[i]);
+                    break;
+
+                case '-':
+                    i = ParseLongOption(argc, argv, i);
+                    break;
+
                 default:
                     PrintUsage(argv[0]);
                     break;
             }
         }
     }
+    if (batch_mode && batch_paths.empty()) {
+        PrintUsage(argv[0]);
+    }
+    if (bin_path.empty() && !bench_mode && !batch_mode) {
+        bin_path = xml_path.substr(0, xml_path.find_last_of('.'));
+        if (!unpack_mode) {
+            bin_path += ".bin";
+        }
+    }
 }
 
 void PrintXmlError(tinyxml2::XMLError error_code)
@@ -67,581 +358,2623 @@ void PrintXmlError(tinyxml2::XMLError error_code)
     }
 }
 
-void WriteU8(FILE *file, uint8_t value)
+// An element's start tag, as XmlReader returns it
+struct XmlElement {
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> attributes;
+    uint32_t depth; // 0 for the root
+    uint32_t line;
+
+    const std::string *Find(const char *attribute_name) const
+    {
+        for (size_t i = 0; i < attributes.size(); i++) {
+            if (attributes[i].first == attribute_name) {
+                return &attributes[i].second;
+            }
+        }
+        return NULL;
+    }
+};
+
+#define XML_BUF_SIZE 0x10000
+
+// Reads an XML file one start tag at a time, holding a block of the file
+// and the names of the open elements instead of the whole document. Text,
+// comments, declarations and processing instructions are skipped; attribute
+// values have entity and character references decoded.
+struct XmlReader {
+    std::string path;
+    FILE *file;
+    std::vector<char> buf;
+    size_t buf_pos;
+    size_t buf_end;
+    uint32_t line;
+    std::vector<std::string> open_names;
+    bool root_read;
+    std::string error; // with the file and line, once reading has failed
+
+    bool Open(const std::string &xml_path)
+    {
+        path = xml_path;
+        file = fopen(path.c_str(), "rb");
+        buf.resize(XML_BUF_SIZE);
+        buf_pos = buf_end = 0;
+        line = 1;
+        open_names.clear();
+        root_read = false;
+        error.clear();
+        return file != NULL;
+    }
+
+    void Close()
+    {
+        fclose(file);
+    }
+
+    bool Fail(const std::string &message)
+    {
+        if (error.empty()) {
+            error = path + ":" + std::to_string(line) + ": " + message;
+        }
+        return false;
+    }
+
+    int Peek()
+    {
+        if (buf_pos == buf_end) {
+            buf_pos = 0;
+            buf_end = fread(buf.data(), 1, buf.size(), file);
+            if (buf_end == 0) {
+                return EOF;
+            }
+        }
+        return (unsigned char)buf[buf_pos];
+    }
+
+    int Get()
+    {
+        int c = Peek();
+        if (c != EOF) {
+            buf_pos++;
+            line += c == '\n';
+        }
+        return c;
+    }
+
+    static bool IsSpace(int c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    void SkipSpace()
+    {
+        while (IsSpace(Peek())) {
+            Get();
+        }
+    }
+
+    bool SkipPast(const char *end)
+    {
+        size_t matched = 0;
+        while (end[matched] != 0) {
+            int c = Get();
+            if (c == EOF) {
+                return Fail(std::string("no ") + end + " before the end of the file");
+            }
+            matched = c == end[matched] ? matched + 1 : (c == end[0] ? 1 : 0);
+        }
+        return true;
+    }
+
+    std::string ReadName()
+    {
+        std::string name;
+        int c = Peek();
+        while (c != EOF && !IsSpace(c) && !strchr("=<>/\"'", c)) {
+            name += (char)Get();
+            c = Peek();
+        }
+        return name;
+    }
+
+    static void AppendUtf8(std::string &str, uint32_t code)
+    {
+        if (code < 0x80) {
+            str += (char)code;
+        } else if (code < 0x800) {
+            str += (char)(0xC0 | (code >> 6));
+            str += (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            str += (char)(0xE0 | (code >> 12));
+            str += (char)(0x80 | ((code >> 6) & 0x3F));
+            str += (char)(0x80 | (code & 0x3F));
+        } else {
+            str += (char)(0xF0 | (code >> 18));
+            str += (char)(0x80 | ((code >> 12) & 0x3F));
+            str += (char)(0x80 | ((code >> 6) & 0x3F));
+            str += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool ReadValue(std::string &value)
+    {
+        int quote = Get();
+        if (quote != '"' && quote != '\'') {
+            return Fail("attribute value is not quoted");
+        }
+        value.clear();
+        for (;;) {
+            int c = Get();
+            if (c == quote) {
+                return true;
+            } else if (c == EOF || c == '<') {
+                return Fail("attribute value is not closed");
+            } else if (c != '&') {
+                value += (char)c;
+                continue;
+            }
+            std::string ref;
+            while ((c = Get()) != ';') {
+                if (c == EOF || ref.size() > 8) {
+                    return Fail("& is not followed by a reference");
+                }
+                ref += (char)c;
+            }
+            if (ref == "amp") {
+                value += '&';
+            } else if (ref == "lt") {
+                value += '<';
+            } else if (ref == "gt") {
+                value += '>';
+            } else if (ref == "quot") {
+                value += '"';
+            } else if (ref == "apos") {
+                value += '\'';
+            } else if (ref.size() > 1 && ref[0] == '#') {
+                char *end;
+                bool hex = ref[1] == 'x';
+                unsigned long code = strtoul(ref.c_str() + (hex ? 2 : 1), &end, hex ? 16 : 10);
+                if (*end != 0 || code == 0 || code > 0x10FFFF) {
+                    return Fail("&" + ref + "; is not a valid character");
+                }
+                AppendUtf8(value, code);
+            } else {
+                return Fail("&" + ref + "; is not a known entity");
+            }
+        }
+    }
+
+    // Reads up to the next start tag. Returns false at the end of the
+    // file, and on malformed input with error set.
+    bool Next(XmlElement &element)
+    {
+        for (;;) {
+            int c;
+            while ((c = Get()) != '<') {
+                if (c == EOF) {
+                    if (!open_names.empty()) {
+                        return Fail("<" + open_names.back() + "> is not closed");
+                    }
+                    return false;
+                }
+            }
+            c = Peek();
+            if (c == '?') {
+                if (!SkipPast("?>")) {
+                    return false;
+                }
+                continue;
+            } else if (c == '!') {
+                Get();
+                if (!SkipPast(Peek() == '-' ? "-->" : ">")) {
+                    return false;
+                }
+                continue;
+            } else if (c == '/') {
+                Get();
+                std::string name = ReadName();
+                SkipSpace();
+                if (Get() != '>' || open_names.empty() || open_names.back() != name) {
+                    return Fail("</" + name + "> does not close the open element");
+                }
+                open_names.pop_back();
+                continue;
+            }
+            element.line = line;
+            element.name = ReadName();
+            element.depth = open_names.size();
+            element.attributes.clear();
+            if (element.name.empty()) {
+                return Fail("< is not followed by an element name");
+            }
+            if (element.depth == 0 && root_read) {
+                return Fail("<" + element.name + "> follows the root element");
+            }
+            root_read = true;
+            for (;;) {
+                SkipSpace();
+                c = Peek();
+                if (c == '>') {
+                    Get();
+                    open_names.push_back(element.name);
+                    return true;
+                } else if (c == '/') {
+                    Get();
+                    if (Get() != '>') {
+                        return Fail("/ in <" + element.name + "> is not followed by >");
+                    }
+                    return true;
+                }
+                std::string name = ReadName();
+                SkipSpace();
+                if (name.empty() || Get() != '=') {
+                    return Fail("<" + element.name + "> has a malformed attribute");
+                }
+                SkipSpace();
+                std::string value;
+                if (!ReadValue(value)) {
+                    return false;
+                }
+                element.attributes.push_back(std::make_pair(name, value));
+            }
+        }
+    }
+};
+
+// Reads an attribute that may be left out, keeping value when it is.
+// Numbers are decimal, or hex after 0x.
+template <typename T>
+void QueryOptionalAttribute(const XmlReader &reader, const XmlElement &element, const char *name, T *value)
+{
+    const std::string *text = element.Find(name);
+    if (!text) {
+        return;
+    }
+    const char *start = text->c_str();
+    char *end;
+    bool hex = start[0] == '0' && (start[1] == 'x' || start[1] == 'X');
+    long long number = strtoll(start, &end, hex ? 16 : 10);
+    if (text->empty() || *end != 0 || number < (long long)std::numeric_limits<T>::min()
+        || number > (long long)std::numeric_limits<T>::max()) {
+        PrintError("%s:%u: %s=\"%s\" is not a valid number.\n", reader.path.c_str(), element.line, name,
+            text->c_str());
+    }
+    *value = (T)number;
+}
+
+const std::string &GetRequiredAttribute(const XmlReader &reader, const XmlElement &element, const char *name)
 {
-    fwrite(&value, 1, 1, file);
+    const std::string *text = element.Find(name);
+    if (!text) {
+        PrintError("%s:%u: <%s> has no %s attribute.\n", reader.path.c_str(), element.line, element.name.c_str(),
+            name);
+    }
+    return *text;
 }
 
-void WriteS8(FILE *file, int8_t value)
+// Escapes str for use inside a JSON string literal.
+std::string JsonEscape(const std::string &str)
 {
-    fwrite(&value, 1, 1, file);
+    std::string out;
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char code[8];
+            sprintf(code, "\\u%04x", c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out;
 }
 
-void WriteU16(FILE *file, uint16_t value)
+std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+// Microseconds since the program started
+uint64_t GetTime()
 {
-    uint8_t temp[2];
-    temp[0] = value >> 8;
-    temp[1] = value & 0xFF;
-    fwrite(temp, 2, 1, file);
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
 }
 
-void WriteS16(FILE *file, int16_t value)
+struct TraceEvent {
+    std::string name;
+    std::string args; // members of the event's args object, already JSON
+    uint64_t start;
+    uint64_t dur;
+    uint32_t tid;
+};
+
+std::vector<TraceEvent> trace_events;
+std::mutex trace_mutex;
+std::atomic<uint32_t> trace_thread_count;
+
+// Small thread numbers for the trace, the main thread being 0 as it
+// opens the first span.
+uint32_t GetTraceThread()
 {
-    int8_t temp[2];
-    temp[0] = value >> 8;
-    temp[1] = value & 0xFF;
-    fwrite(temp, 2, 1, file);
+    static thread_local uint32_t tid = trace_thread_count++;
+    return tid;
 }
 
-void WriteU32(FILE *file, uint32_t value)
+// Times the scope it lives in. With --trace the span is recorded as a
+// complete event when it ends.
+struct TraceSpan {
+    std::string name;
+    std::string args;
+    uint64_t start;
+    uint32_t tid;
+    bool ended;
+
+    TraceSpan(const std::string &span_name) : name(span_name), start(GetTime()), tid(GetTraceThread()), ended(false)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        End();
+    }
+
+    // Returns the span's length in seconds.
+    double End()
+    {
+        uint64_t dur = GetTime() - start;
+        if (!ended && !trace_path.empty()) {
+            TraceEvent event = { name, args, start, dur, tid };
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            trace_events.push_back(event);
+        }
+        ended = true;
+        return dur / 1000000.0;
+    }
+
+    void AddArg(const std::string &arg_name, const std::string &value)
+    {
+        args += (args.empty() ? "\"" : ", \"") + arg_name + "\": \"" + JsonEscape(value) + "\"";
+    }
+};
+
+// Writes the spans in the Chrome trace event format, which Perfetto and
+// chrome://tracing both open.
+void WriteTrace()
 {
-    uint8_t temp[4];
-    temp[0] = value >> 24;
-    temp[1] = (value >> 16) & 0xFF;
-    temp[2] = (value >> 8) & 0xFF;
-    temp[3] = value & 0xFF;
-    fwrite(temp, 4, 1, file);
+    FILE *file = fopen(trace_path.c_str(), "w");
+    if (!file) {
+        PrintError("Failed to Open %s for Writing.\n", trace_path.c_str());
+    }
+    fprintf(file, "{\"traceEvents\": [\n");
+    for (uint32_t i = 0; i < trace_thread_count; i++) {
+        std::string thread_name = i == 0 ? "main" : "worker " + std::to_string(i);
+        fprintf(file, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+            "\"args\": {\"name\": \"%s\"}},\n", i, thread_name.c_str());
+    }
+    for (size_t i = 0; i < trace_events.size(); i++) {
+        const TraceEvent &event = trace_events[i];
+        fprintf(file, "  {\"name\": \"%s\", \"cat\": \"mpbinpack\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %llu, "
+            "\"pid\": 1, \"tid\": %u, \"args\": {%s}}%s\n", JsonEscape(event.name).c_str(),
+            (unsigned long long)event.start, (unsigned long long)event.dur, event.tid, event.args.c_str(),
+            i + 1 < trace_events.size() ? "," : "");
+    }
+    fprintf(file, "], \"displayTimeUnit\": \"ms\"}\n");
+    if (fclose(file) != 0) {
+        PrintError("Failed to Write %s.\n", trace_path.c_str());
+    }
 }
 
-void WriteS32(FILE *file, int32_t value)
+struct ContentHash {
+    uint64_t fnv;
+    uint32_t crc;
+    uint32_t size;
+};
+
+struct FileEntry {
+    std::string id;
+    std::string path;
+    uint32_t comp_type;
+    uint32_t dup_index; // entry whose stored data this one shares
+    bool stream; // compressed on the writing thread straight into the archive
+    uint32_t align;
+    uint32_t payload_align;
+    int order; // position in the archive data, lowest first
+    std::string group; // entries stored next to each other
+    bool hashed;
+    ContentHash hash;
+    uint32_t size; // of the source when the manifest was read
+    uint64_t mtime; // for --update
+};
+
+struct CompressJob {
+    InputFile input; // open from ReadEntry until the entry is compressed
+    std::vector<uint8_t> data;
+    uint32_t raw_size;
+    uint32_t comp_type;
+    uint32_t comp_size;
+    bool read;
+    bool done;
+    // seconds spent on each step, for --stats
+    double read_time;
+    double compress_time;
+    double write_time;
+    // extra buffer bytes needed to decode in place, and decoder scratch
+    // memory, when --stats, --header-inplace, --update or --inplace-budget
+    // asks for them
+    uint32_t inplace_margin;
+    uint32_t decode_scratch;
+};
+
+// One manifest and the archive packed from it
+struct Manifest {
+    std::string xml_path;
+    std::string bin_path;
+    std::string header_path;
+    std::vector<FileEntry> file_entry_list;
+    std::vector<uint32_t> write_order; // entry indices in the order their data is stored
+    std::vector<CompressJob> job_list;
+    std::vector<std::string> dir_paths; // listed by <dir> elements
+};
+
+std::atomic<uint32_t> next_job;
+
+// PackArchive runs as a pipeline over write_order. Prefetch threads read
+// the sources ahead, compress threads take them in order as they arrive and
+// the main thread writes the results in order. Reading stops queue_depth
+// entries past the last one written, which bounds the sources and output
+// held in memory.
+std::mutex job_mutex;
+std::condition_variable job_cond;
+uint32_t next_read; // positions in write_order
+uint32_t next_compress;
+uint32_t written_count;
+std::atomic<uint32_t> cache_hits;
+std::atomic<uint32_t> cache_misses;
+
+// Bump when an encoder change alters its output, so stale cache entries
+// stop matching.
+#define CACHE_VERSION 1
+
+void HashData(ByteSpan src, ContentHash *hash)
 {
-    int8_t temp[4];
-    temp[0] = value >> 24;
-    temp[1] = (value >> 16) & 0xFF;
-    temp[2] = (value >> 8) & 0xFF;
-    temp[3] = value & 0xFF;
-    fwrite(temp, 4, 1, file);
+    hash->fnv = 14695981039346656037ULL;
+    for (uint32_t i = 0; i < src.size; i++) {
+        hash->fnv = (hash->fnv ^ src.data[i]) * 1099511628211ULL;
+    }
+    hash->crc = crc32(crc32(0L, Z_NULL, 0), src.data, src.size);
+    hash->size = src.size;
 }
 
-void WriteFloat(FILE *file, float value)
+// Cache entries are named after the input contents and every setting the
+// chosen encoder's output depends on.
+std::string GetCacheKey(const ContentHash &hash, uint32_t comp_type)
 {
-    WriteS32(file, *(int32_t *)&value);
+    std::string settings = "v" + std::to_string(CACHE_VERSION) + "t" + std::to_string(comp_type);
+    if (comp_type == COMP_TYPE_LZSS || comp_type == COMP_TYPE_SLIDE) {
+        settings += compress_options.optimal_parse ? "o" : "g";
+    }
+    if (comp_type == COMP_TYPE_SLIDE && !compress_options.optimal_parse) {
+        settings += compress_options.match_mode == MATCH_FAST ? "f" : "c";
+    }
+    if (comp_type == COMP_TYPE_ZLIB && compress_options.zlib_iterations != 0) {
+        settings += "i" + std::to_string(compress_options.zlib_iterations);
+    }
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx%08x%08x", (unsigned long long)hash.fnv, hash.crc, hash.size);
+    return key + ("_" + settings);
 }
 
-#define N 1024   /* size of ring buffer */   
-#define F 66   /* upper limit for match_length */   
-#define THRESHOLD 2 /* encode string into position and length  if match_length is greater than this */
-#define NIL  N /* index for root of binary search trees */   
+std::string GetCachePath(const std::string &key)
+{
+    std::string path = cache_dir;
+    if (path.find_last_of("\\/") != path.size() - 1) {
+        path += "/";
+    }
+    return path + key + ".bin";
+}
 
-uint8_t text_buf[N + F - 1];    /* ring buffer of size N,
-        with extra F-1 bytes to facilitate string comparison */
-int match_position, match_length,  /* of longest match.  These are
-                        set by the InsertNode() procedure. */
-    lson[N + 1], rson[N + 257], dad[N + 1];  /* left & right children &
-            parents -- These constitute binary search trees. */
+bool ReadCache(const std::string &key, std::vector<uint8_t> &data)
+{
+    if (!ReadWholeFile(GetCachePath(key), data)) {
+        data.clear();
+        return false;
+    }
+    return true;
+}
 
-void InitTree(void)  /* initialize trees */
+void WriteCache(const std::string &key, const std::vector<uint8_t> &data)
 {
-    int  i;
+    // write under a private name and rename, so concurrent builds sharing
+    // the directory never see a partial entry
+    MakeDirectory(cache_dir);
+    std::string path = GetCachePath(key);
+    std::string temp_path = GetTempPath(path);
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    bool success = fwrite(data.data(), 1, data.size(), file) == data.size();
+    success = fclose(file) == 0 && success;
+    if (!success || !RenameFile(temp_path, path)) {
+        remove(temp_path.c_str());
+    }
+}
 
-    /* For i = 0 to N - 1, rson[i] and lson[i] will be the right and
-       left children of node i.  These nodes need not be initialized.
-       Also, dad[i] is the parent of node i.  These are initialized to
-       NIL (= N), which stands for 'not used.'
-       For i = 0 to 255, rson[N + i + 1] is the root of the tree
-       for strings that begin with character i.  These are initialized
-       to NIL.  Note there are 256 trees. */
+// Same as CompressBuffer, going through the cache when one is set.
+uint32_t CompressFile(FileEntry &entry, ByteSpan src, uint32_t comp_type, std::vector<uint8_t> &data)
+{
+    uint32_t comp_size = src.size;
+    std::string cache_key;
+    TraceSpan span("Compress " + GetCompTypeName(comp_type));
+    span.AddArg("path", entry.path);
+    data.clear();
+    if (!cache_dir.empty() && comp_type != COMP_TYPE_NONE) {
+        if (!entry.hashed) {
+            HashData(src, &entry.hash);
+            entry.hashed = true;
+        }
+        cache_key = GetCacheKey(entry.hash, comp_type);
+        if (ReadCache(cache_key, data)) {
+            span.AddArg("cache", "hit");
+            cache_hits++;
+            return data.size();
+        }
+        cache_misses++;
+    }
+    comp_size = CompressBuffer(src, comp_type, data, compress_options);
+    if (!cache_key.empty()) {
+        WriteCache(cache_key, data);
+    }
+    return comp_size;
+}
 
-    for (i = N + 1; i <= N + 256; i++) rson[i] = NIL;
-    for (i = 0; i < N; i++) dad[i] = NIL;
+// Whether the entry is compressed on its own, rather than sharing another
+// entry's data or being streamed by the writer
+bool IsCompressed(Manifest &manifest, uint32_t index)
+{
+    return manifest.file_entry_list[index].dup_index == index && !manifest.file_entry_list[index].stream;
 }
 
-void InsertNode(int r)
-/* Inserts string of length F, text_buf[r..r+F-1], into one of the
-   trees (text_buf[r]'th tree) and returns the longest-match position
-   and length via the global variables match_position and match_length.
-   If match_length = F, then removes the old node in favor of the new
-   one, because the old one will be deleted sooner.
-   Note r plays double role, as tree node and position in buffer. */
+// Maps the entry's source and pulls it into memory.
+void ReadEntry(Manifest &manifest, uint32_t index)
 {
-    int  i, p, cmp;
-    uint8_t *key;
+    FileEntry &entry = manifest.file_entry_list[index];
+    CompressJob &job = manifest.job_list[index];
+    TraceSpan read_span("Read");
+    read_span.AddArg("path", entry.path);
+    if (!job.input.Open(entry.path)) {
+        PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
+    }
+    job.input.Prefetch();
+    job.read_time = read_span.End();
+}
 
-    cmp = 1;  key = &text_buf[r];  p = N + 1 + key[0];
-    rson[r] = lson[r] = NIL;  match_length = 0;
-    for (; ; ) {
-        if (cmp >= 0) {
-            if (rson[p] != NIL) p = rson[p];
-            else { rson[p] = r;  dad[r] = p;  return; }
-        }
-        else {
-            if (lson[p] != NIL) p = lson[p];
-            else { lson[p] = r;  dad[r] = p;  return; }
+void CompressEntry(Manifest &manifest, uint32_t index)
+{
+    FileEntry &entry = manifest.file_entry_list[index];
+    CompressJob &job = manifest.job_list[index];
+    InputFile &input = job.input;
+    if (!IsCompressed(manifest, index)) {
+        return;
+    }
+    if (!job.read) {
+        ReadEntry(manifest, index);
+    }
+    job.raw_size = input.span.size;
+    TraceSpan compress_span("Compress entry");
+    compress_span.AddArg("path", entry.path);
+    if (entry.comp_type != COMP_TYPE_AUTO) {
+        job.comp_type = entry.comp_type;
+        job.comp_size = CompressFile(entry, input.span, job.comp_type, job.data);
+    } else {
+        job.comp_size = CompressAuto(input.span, job.data, &job.comp_type, compress_options,
+            [&entry](ByteSpan src, uint32_t comp_type, std::vector<uint8_t> &data) {
+                return CompressFile(entry, src, comp_type, data);
+            });
+    }
+    if (update_mode && !entry.hashed) {
+        HashData(input.span, &entry.hash);
+        entry.hashed = true;
+    }
+    if (stats_mode || header_inplace || update_mode || compress_options.inplace_budget != 0xFFFFFFFF) {
+        ByteSpan data = { job.data.data(), (uint32_t)job.data.size() };
+        if (!GetInPlaceMargin(data, job.comp_type, job.raw_size, &job.inplace_margin)) {
+            PrintError("Failed to decode %s.\n", entry.path.c_str());
         }
-        for (i = 1; i < F; i++)
-            if ((cmp = key[i] - text_buf[p + i]) != 0)  break;
-        if (i > match_length) {
-            match_position = p;
-            if ((match_length = i) >= F)  break;
+        if (job.inplace_margin > compress_options.inplace_budget) {
+            job.comp_type = COMP_TYPE_NONE;
+            job.comp_size = CompressFile(entry, input.span, job.comp_type, job.data);
+            job.inplace_margin = 0;
         }
+        job.decode_scratch = GetDecodeScratch({ job.data.data(), (uint32_t)job.data.size() }, job.comp_type);
     }
-    dad[r] = dad[p];  lson[r] = lson[p];  rson[r] = rson[p];
-    dad[lson[p]] = r;  dad[rson[p]] = r;
-    if (rson[dad[p]] == p) rson[dad[p]] = r;
-    else                   lson[dad[p]] = r;
-    dad[p] = NIL;  /* remove p */
+    job.compress_time = compress_span.End();
+    input.Close();
 }
 
-void DeleteNode(int p)  /* deletes node p from tree */
+bool FilesEqual(const std::string &path1, const std::string &path2)
 {
-    int  q;
+    InputFile file1;
+    InputFile file2;
+    bool equal = file1.Open(path1) && file2.Open(path2) && file1.span.size == file2.span.size
+        && (file1.span.size == 0 || memcmp(file1.span.data, file2.span.data, file1.span.size) == 0);
+    file1.Close();
+    file2.Close();
+    return equal;
+}
 
-    if (dad[p] == NIL) return;  /* not in tree */
-    if (rson[p] == NIL) q = lson[p];
-    else if (lson[p] == NIL) q = rson[p];
-    else {
-        q = lson[p];
-        if (rson[q] != NIL) {
-            do { q = rson[q]; } while (rson[q] != NIL);
-            rson[dad[q]] = lson[q];  dad[lson[q]] = dad[q];
-            lson[q] = lson[p];  dad[lson[p]] = q;
-        }
-        rson[q] = rson[p];  dad[rson[p]] = q;
-    }
-    dad[q] = dad[p];
-    if (rson[dad[p]] == p) rson[dad[p]] = q;  else lson[dad[p]] = q;
-    dad[p] = NIL;
+// Sorts entries by order, keeping each group together at the place of its
+// lowest ordered member and manifest order among equals.
+void SetWriteOrder(Manifest &manifest)
+{
+    std::map<std::string, std::pair<int, uint32_t>> group_keys;
+    std::vector<std::pair<int, uint32_t>> keys;
+    for (uint32_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        const FileEntry &entry = manifest.file_entry_list[i];
+        std::pair<int, uint32_t> key(entry.order, i);
+        if (!entry.group.empty()) {
+            auto it = group_keys.insert(std::make_pair(entry.group, key)).first;
+            it->second.first = std::min(it->second.first, entry.order);
+        }
+        keys.push_back(key);
+    }
+    for (uint32_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        if (!manifest.file_entry_list[i].group.empty()) {
+            keys[i] = group_keys[manifest.file_entry_list[i].group];
+        }
+    }
+    manifest.write_order.resize(manifest.file_entry_list.size());
+    for (uint32_t i = 0; i < manifest.write_order.size(); i++) {
+        manifest.write_order[i] = i;
+    }
+    const std::vector<FileEntry> &entries = manifest.file_entry_list;
+    std::stable_sort(manifest.write_order.begin(), manifest.write_order.end(), [&entries, &keys](uint32_t a, uint32_t b) {
+        if (keys[a] != keys[b]) {
+            return keys[a] < keys[b];
+        }
+        return entries[a].order < entries[b].order;
+    });
 }
-
-uint32_t CompressLzss(FILE *dst_file, FILE *src_file)
-{
-    int  i, c, len, r, s, last_match_length, code_buf_ptr;
-    uint8_t code_buf[17], mask;
-    uint32_t codesize = 0;
-
-    InitTree();  /* initialize trees */
-    code_buf[0] = 0;  /* code_buf[1..16] saves eight units of code, and
-            code_buf[0] works as eight flags, "1" representing that the unit
-            is an unencoded letter (1 byte), "0" a position-and-length pair
-            (2 bytes).  Thus, eight units require at most 16 bytes of code. */
-    code_buf_ptr = mask = 1;
-    s = 0;  r = N - F;
-    for (i = s; i < r; i++) text_buf[i] = '\0';  /* Clear the buffer with
-            any character that will appear often. */
-    for (len = 0; len < F && (c = getc(src_file)) != EOF; len++)
-        text_buf[r + len] = c;  /* Read F bytes into the last F bytes of
-                the buffer */
-    if (len == 0) return 0;  /* text of size zero */
-    for (i = 1; i <= F; i++) InsertNode(r - i);  /* Insert the F strings,
-            each of which begins with one or more 'space' characters.  Note
-            the order in which these strings are inserted.  This way,
-            degenerate trees will be less likely to occur. */
-    InsertNode(r);  /* Finally, insert the whole string just read.  The
-            global variables match_length and match_position are set. */
-    do {
-        if (match_length > len) match_length = len;  /* match_length
-                may be spuriously long near the end of text. */
-        if (match_length <= THRESHOLD) {
-            match_length = 1;  /* Not long enough match.  Send one byte. */
-            code_buf[0] |= mask;  /* 'send one byte' flag */
-            code_buf[code_buf_ptr++] = text_buf[r];  /* Send uncoded. */
-        }
-        else {
-            code_buf[code_buf_ptr++] = (uint8_t)match_position;
-            code_buf[code_buf_ptr++] = (uint8_t)
-                (((match_position >> 2) & 0xC0)
-                    | (match_length - (THRESHOLD + 1)));  /* Send position and
-                                  length pair. Note match_length > THRESHOLD. */
-        }
-        if ((mask <<= 1) == 0) {  /* Shift mask left one bit. */
-            for (i = 0; i < code_buf_ptr; i++)  /* Send at most 8 units of */
-                putc(code_buf[i], dst_file);     /* code together */
-            codesize += code_buf_ptr;
-            code_buf[0] = 0;  code_buf_ptr = mask = 1;
-        }
-        last_match_length = match_length;
-        for (i = 0; i < last_match_length &&
-            (c = getc(src_file)) != EOF; i++) {
-            DeleteNode(s);          /* Delete old strings and */
-            text_buf[s] = c;        /* read new bytes */
-            if (s < F - 1) text_buf[s + N] = c;  /* If the position is
-                    near the end of buffer, extend the buffer to make
-                    string comparison easier. */
-            s = (s + 1) & (N - 1);  r = (r + 1) & (N - 1);
-            /* Since this is a ring buffer, increment the position
-               modulo N. */
-            InsertNode(r);  /* Register the string in text_buf[r..r+F-1] */
-        }
-        while (i++ < last_match_length) {       /* After the end of text, */
-            DeleteNode(s);                                  /* no need to read, but */
-            s = (s + 1) & (N - 1);  r = (r + 1) & (N - 1);
-            if (--len) InsertNode(r);               /* buffer may not be empty. */
-        }
-    } while (len > 0);      /* until length of string to be processed is zero */
-    if (code_buf_ptr > 1) {         /* Send remaining code. */
-        for (i = 0; i < code_buf_ptr; i++) putc(code_buf[i], dst_file);
-        codesize += code_buf_ptr;
-    }
-    return codesize;
-}
-
-// simple and straight encoding scheme for Yaz0
-uint32_t simpleEnc(uint8_t *src, uint32_t size, uint32_t pos, uint32_t *pMatchPos)
-{
-    uint32_t startPos = pos - 0x1000;
-    uint32_t numBytes = 1;
-    uint32_t matchPos = 0;
-    uint32_t i;
-    uint32_t j;
-
-    if (pos < 0x1000)
-        startPos = 0;
-    for (i = startPos; i < pos; i++)
-    {
-        for (j = 0; j < size - pos; j++)
-        {
-            if (src[i + j] != src[j + pos])
+
+// Points every entry at the first entry stored before it with the same
+// contents and compression type. Returns the number of duplicates found.
+uint32_t FindDuplicates(Manifest &manifest)
+{
+    std::map<std::pair<uint64_t, uint64_t>, std::vector<uint32_t>> owner_map;
+    uint32_t dup_count = 0;
+    for (uint32_t k = 0; k < manifest.write_order.size(); k++) {
+        uint32_t i = manifest.write_order[k];
+        FileEntry &entry = manifest.file_entry_list[i];
+        // --watch keeps the hashes of sources that have not changed
+        if (!entry.hashed) {
+            InputFile input;
+            if (!input.Open(entry.path)) {
+                PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
+            }
+            HashData(input.span, &entry.hash);
+            entry.hashed = true;
+            input.Close();
+        }
+        std::vector<uint32_t> &owners = owner_map[std::make_pair(entry.hash.fnv,
+            ((uint64_t)entry.hash.crc << 32) | entry.hash.size)];
+        for (size_t j = 0; j < owners.size(); j++) {
+            FileEntry &owner = manifest.file_entry_list[owners[j]];
+            if (owner.comp_type == entry.comp_type && FilesEqual(owner.path, entry.path)) {
+                entry.dup_index = owners[j];
+                dup_count++;
                 break;
+            }
         }
-        if (j > numBytes)
-        {
-            numBytes = j;
-            matchPos = i;
+        if (entry.dup_index == i) {
+            owners.push_back(i);
         }
     }
-    *pMatchPos = matchPos;
-    if (numBytes == 2)
-        numBytes = 1;
-    return numBytes;
+    return dup_count;
 }
 
-// a lookahead encoding scheme for ngc Yaz0
-uint32_t nintendoEnc(uint8_t* src, uint32_t size, uint32_t pos, uint32_t *pMatchPos)
+// Compresses a --stream-min entry as it is read, writing the output
+// straight into the archive. Returns the entry's offset.
+uint32_t StreamEntry(Manifest &manifest, uint32_t index, ArchiveWriter &writer)
 {
-    uint32_t numBytes = 1;
-    static uint32_t numBytes1;
-    static uint32_t matchPos;
-    static int prevFlag = 0;
-
-    // if prevFlag is set, it means that the previous position was determined by look-ahead try.
-    // so just use it. this is not the best optimization, but nintendo's choice for speed.
-    if (prevFlag == 1) {
-        *pMatchPos = matchPos;
-        prevFlag = 0;
-        return numBytes1;
+    FileEntry &entry = manifest.file_entry_list[index];
+    CompressJob &job = manifest.job_list[index];
+    TraceSpan span("Stream " + GetCompTypeName(entry.comp_type));
+    span.AddArg("path", entry.path);
+    FILE *file = fopen(entry.path.c_str(), "rb");
+    if (!file) {
+        PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
     }
-    prevFlag = 0;
-    numBytes = simpleEnc(src, size, pos, &matchPos);
-    *pMatchPos = matchPos;
+    fseek(file, 0, SEEK_END);
+    job.raw_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    job.comp_type = entry.comp_type;
+    uint32_t entry_ofs = writer.WriteEntry(job.raw_size, job.comp_type, std::vector<uint8_t>());
+    uint32_t data_ofs = writer.ofs;
+    StreamSink sink;
+    sink.write = [&writer](const uint8_t *data, size_t len) {
+        writer.Write(data, len);
+    };
+    sink.patch = [&writer, data_ofs](uint32_t ofs, const uint8_t *data, size_t len) {
+        writer.Patch(data_ofs + ofs, data, len);
+    };
+    if (!CompressStream(MakeFileReader(file), job.raw_size, job.comp_type, sink, compress_options, &job.comp_size)) {
+        PrintError("Failed to Read %s.\n", entry.path.c_str());
+    }
+    fclose(file);
+    job.compress_time = span.End();
+    return entry_ofs;
+}
 
-    // if this position is RLE encoded, then compare to copying 1 byte and next position(pos+1) encoding
-    if (numBytes >= 3) {
-        numBytes1 = simpleEnc(src, size, pos + 1, &matchPos);
-        // if the next position encoding is +2 longer than current position, choose it.
-        // this does not guarantee the best optimization, but fairly good optimization with speed.
-        if (numBytes1 >= numBytes + 2) {
-            numBytes = 1;
-            prevFlag = 1;
+void PrefetchWorker(Manifest &manifest)
+{
+    std::unique_lock<std::mutex> lock(job_mutex);
+    while (next_read < manifest.write_order.size()) {
+        if (next_read >= written_count + queue_depth) {
+            job_cond.wait(lock);
+            continue;
+        }
+        uint32_t index = manifest.write_order[next_read++];
+        lock.unlock();
+        if (IsCompressed(manifest, index)) {
+            ReadEntry(manifest, index);
         }
+        lock.lock();
+        manifest.job_list[index].read = true;
+        job_cond.notify_all();
     }
-    return numBytes;
 }
 
-struct Ret
+void CompressWorker(Manifest &manifest)
 {
-    uint32_t srcPos, dstPos;
+    std::unique_lock<std::mutex> lock(job_mutex);
+    while (next_compress < manifest.write_order.size()) {
+        uint32_t index = manifest.write_order[next_compress];
+        if (!manifest.job_list[index].read) {
+            job_cond.wait(lock);
+            continue;
+        }
+        next_compress++;
+        lock.unlock();
+        CompressEntry(manifest, index);
+        lock.lock();
+        manifest.job_list[index].done = true;
+        job_cond.notify_all();
+    }
+}
+
+// --update keeps a sidecar beside the archive recording where each entry is
+// stored and what it was packed from, so changed sources are found without
+// decoding the archive.
+struct EntryState {
+    uint32_t ofs;
+    uint32_t size; // header and data
+    uint32_t comp_type; // as stored
+    uint32_t source_type; // as in the manifest, which may be auto
+    ContentHash hash;
+    uint64_t mtime;
+    uint32_t inplace_margin;
+    uint32_t decode_scratch;
+    uint32_t align;
+    uint32_t payload_align;
+    uint32_t position; // in write_order
 };
 
-uint32_t CompressSlide(FILE *file_dst, FILE *src, uint32_t len)
+std::string GetHashesPath(Manifest &manifest)
 {
-    Ret r = { 0, 0 };
-    uint8_t dst[96];    // 32 codes * 3 bytes maximum
-    uint32_t dstSize = 4;
+    return manifest.bin_path + ".hashes";
+}
 
-    uint32_t validBitCount = 0; //number of valid bits left in "code" byte
-    uint32_t currCodeByte = 0;
-    uint8_t *input = new uint8_t[len];
-    fread(input, 1, len, src);
-    WriteU32(file_dst, len);
-    while (r.srcPos < len)
-    {
-        uint32_t numBytes;
-        uint32_t matchPos;
-        uint32_t srcPosBak;
+// Names every option that changes an encoder's output or the archive
+// layout. A sidecar written with other settings is ignored.
+std::string GetSettingsKey()
+{
+    char key[64];
+    snprintf(key, sizeof(key), "v%u_m%u_o%u_c%u_b%u_z%u_a%u_p%u", CACHE_VERSION,
+        (uint32_t)compress_options.match_mode, (uint32_t)compress_options.optimal_parse,
+        compress_options.max_decode_cost, compress_options.inplace_budget, compress_options.zlib_iterations,
+        entry_align, entry_payload_align);
+    return key;
+}
 
-        numBytes = nintendoEnc(input, len, r.srcPos, &matchPos);
-        if (numBytes < 3)
-        {
-            //straight copy
-            dst[r.dstPos] = input[r.srcPos];
-            r.dstPos++;
-            r.srcPos++;
-            //set flag for straight copy
-            currCodeByte |= (0x80000000 >> validBitCount);
-        }
-        else
-        {
-            //RLE part
-            uint32_t dist = r.srcPos - matchPos - 1;
-            uint8_t byte1, byte2, byte3;
-
-            if (numBytes >= 0x12)  // 3 byte encoding
-            {
-                byte1 = 0 | (dist >> 8);
-                byte2 = dist & 0xff;
-                dst[r.dstPos++] = byte1;
-                dst[r.dstPos++] = byte2;
-                // maximum runlength for 3 byte encoding
-                if (numBytes > 0xff + 0x12)
-                    numBytes = 0xff + 0x12;
-                byte3 = numBytes - 0x12;
-                dst[r.dstPos++] = byte3;
-            }
-            else  // 2 byte encoding
-            {
-                byte1 = ((numBytes - 2) << 4) | (dist >> 8);
-                byte2 = dist & 0xff;
-                dst[r.dstPos++] = byte1;
-                dst[r.dstPos++] = byte2;
-            }
-            r.srcPos += numBytes;
-        }
-        validBitCount++;
-        //write 32 codes
-        if (validBitCount == 32)
-        {
-            WriteU32(file_dst, currCodeByte);
-            fwrite(dst, 1, r.dstPos, file_dst);
-            dstSize += r.dstPos + 4;
+bool ReadHashes(Manifest &manifest, std::vector<EntryState> &states)
+{
+    std::vector<uint8_t> text;
+    char settings[64];
+    uint32_t count;
+    uint32_t archive_size;
+    uint32_t size;
+    if (!ReadWholeFile(GetHashesPath(manifest), text)) {
+        return false;
+    }
+    text.push_back(0);
+    const char *line = (const char *)text.data();
+    if (sscanf(line, "mpbinpack-hashes %63s %u %u", settings, &count, &archive_size) != 3
+        || settings != GetSettingsKey() || !GetFileSize(manifest.bin_path, &size) || size != archive_size) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        EntryState state;
+        unsigned long long fnv;
+        unsigned long long mtime;
+        line = strchr(line, '\n');
+        if (!line || sscanf(++line, "%x %x %x %x %llx %x %x %llx %x %x %x %x %x", &state.ofs, &state.size,
+            &state.comp_type, &state.source_type, &fnv, &state.hash.crc, &state.hash.size, &mtime,
+            &state.inplace_margin, &state.decode_scratch, &state.align, &state.payload_align,
+            &state.position) != 13) {
+            return false;
+        }
+        state.hash.fnv = fnv;
+        state.mtime = mtime;
+        states.push_back(state);
+    }
+    return true;
+}
 
-            srcPosBak = r.srcPos;
-            currCodeByte = 0;
-            validBitCount = 0;
-            r.dstPos = 0;
+void WriteHashes(Manifest &manifest, const std::vector<uint32_t> &ofs_table)
+{
+    std::string path = GetHashesPath(manifest);
+    std::string temp_path = GetTempPath(path);
+    uint32_t archive_size;
+    if (!GetFileSize(manifest.bin_path, &archive_size)) {
+        PrintError("Failed to Open %s for Reading.\n", manifest.bin_path.c_str());
+    }
+    FILE *file = fopen(temp_path.c_str(), "w");
+    if (!file) {
+        PrintError("Failed to Open %s for Writing.\n", temp_path.c_str());
+    }
+    fprintf(file, "mpbinpack-hashes %s %u %u\n", GetSettingsKey().c_str(), (uint32_t)manifest.file_entry_list.size(),
+        archive_size);
+    std::vector<uint32_t> positions(manifest.write_order.size());
+    for (uint32_t k = 0; k < manifest.write_order.size(); k++) {
+        positions[manifest.write_order[k]] = k;
+    }
+    for (uint32_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        FileEntry &entry = manifest.file_entry_list[i];
+        const CompressJob &job = manifest.job_list[entry.dup_index];
+        if (!entry.hashed) {
+            InputFile input;
+            if (!input.Open(entry.path)) {
+                PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
+            }
+            HashData(input.span, &entry.hash);
+            entry.hashed = true;
+            input.Close();
         }
+        fprintf(file, "%x %x %x %x %016llx %08x %x %llx %x %x %x %x %x\n", ofs_table[i], job.comp_size + 8,
+            job.comp_type, entry.comp_type, (unsigned long long)entry.hash.fnv, entry.hash.crc, entry.hash.size,
+            (unsigned long long)entry.mtime, job.inplace_margin, job.decode_scratch, entry.align,
+            entry.payload_align, positions[i]);
     }
-    if (validBitCount > 0)
-    {
-        WriteU32(file_dst, currCodeByte);
-        fwrite(dst, 1, r.dstPos, file_dst);
-        dstSize += r.dstPos + 4;
-
-        currCodeByte = 0;
-        validBitCount = 0;
-        r.dstPos = 0;
-    }
-    delete[] input;
-    return dstSize;
-}
-
-uint32_t CompressRle(FILE *file_dst, FILE *src, uint32_t len)
-{
-    uint32_t output_pos = 0;
-    uint32_t input_pos = 0;
-    uint32_t i;
-    uint32_t copy_len = 0;
-    uint8_t curr_byte;
-    uint8_t next_byte;
-    uint8_t *input = new uint8_t[len + 2]();
-    fread(input, 1, len, src);
-    while (input_pos < len) {
-        curr_byte = input[input_pos];
-        next_byte = input[input_pos + 1];
-        if (curr_byte == next_byte) {
-            copy_len = 0;
-            for (i = 0; i < 127; i++) {
-                curr_byte = input[input_pos + i];
-                next_byte = input[input_pos + i + 1];
-                if (curr_byte != next_byte || (input_pos + i) >= len) {
-                    break;
-                }
-                copy_len++;
-            }
-            WriteU8(file_dst, copy_len);
-            WriteU8(file_dst, input[input_pos]);
-            output_pos += 2;
-            input_pos += copy_len;
-        }
-        else {
-            copy_len = 0;
-            for (i = 0; i < 127; i++) {
-                curr_byte = input[input_pos + i];
-                next_byte = input[input_pos + i + 1];
-                if (curr_byte == next_byte || (input_pos + i) >= len)
-                {
-                    break;
-                }
-                copy_len++;
-            }
-            WriteU8(file_dst, copy_len | 0x80);
-            fwrite(&input[input_pos], 1, copy_len, file_dst);
-            output_pos += copy_len+1;
-            input_pos += copy_len;
-        }
-    }
-    delete[] input;
-    return output_pos;
-}
-
-#define DEFLATE_BUF_SIZE 16384
-
-uint32_t CompressZlib(FILE *file_dst, FILE *src, uint32_t len)
-{
-    int ret;
-    int flush;
-    uint32_t have;
-    uint32_t size_left = len;
-    uint32_t input_offset = 0;
-    uint32_t output_size = 0;
-    z_stream strm;
-    //static prevents Stack Analysis Warnings
-    static uint8_t in[DEFLATE_BUF_SIZE];
-    static uint8_t out[DEFLATE_BUF_SIZE];
-    uint8_t *input = new uint8_t[len];
-    fread(input, 1, len, src);
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = len;
-    strm.next_in = (Bytef *)input;
-    ret = deflateInit(&strm, Z_BEST_COMPRESSION);
-    if (ret != Z_OK)
-    {
-        return 0;
+    bool success = ferror(file) == 0;
+    success = fclose(file) == 0 && success;
+    if (!success || !RenameFile(temp_path, path)) {
+        remove(temp_path.c_str());
+        PrintError("Failed to Write %s.\n", path.c_str());
     }
-    WriteU32(file_dst, len);
-    size_t comp_len_ofs = ftell(file_dst);
-    WriteU32(file_dst, 0);
-    flush = Z_NO_FLUSH;
-    while (flush != Z_FINISH)
-    {
-        strm.avail_in = DEFLATE_BUF_SIZE;
-        if (size_left < DEFLATE_BUF_SIZE)
-        {
-            strm.avail_in = size_left;
-            flush = Z_FINISH;
-        }
-        memcpy(in, &input[input_offset], strm.avail_in);
-        strm.next_in = in;
-        do {
-            strm.avail_out = DEFLATE_BUF_SIZE;
-            strm.next_out = out;
-            ret = deflate(&strm, flush);    /* no bad return value */
-            have = DEFLATE_BUF_SIZE - strm.avail_out;
-            fwrite(out, 1, have, file_dst);
-            output_size += have;
-        } while (strm.avail_out == 0);
-
-        size_left -= DEFLATE_BUF_SIZE;
-        input_offset += DEFLATE_BUF_SIZE;
-    }
-    size_t data_end_ofs = ftell(file_dst);
-    fseek(file_dst, comp_len_ofs, SEEK_SET);
-    WriteU32(file_dst, output_size);
-    fseek(file_dst, data_end_ofs, SEEK_SET);
-    (void)deflateEnd(&strm);
-    return output_size+8;
-}\
-
-struct FileEntry {
-    std::string id;
-    std::string path;
-    uint32_t comp_type;
-};
+}
 
-std::vector<FileEntry> file_entry_list;
+void WriteZeros(FILE *file, uint32_t len)
+{
+    static const uint8_t zeros[256] = {};
+    while (len > 0) {
+        uint32_t block_len = std::min<uint32_t>(len, sizeof(zeros));
+        fwrite(zeros, 1, block_len, file);
+        len -= block_len;
+    }
+}
 
-uint32_t GetCompTypeValue(std::string type)
+// Compresses the listed entries on -j threads, marking each done.
+void CompressEntries(Manifest &manifest, const std::vector<uint32_t> &compress_list)
 {
-    std::string type_table[4] = { "lzss", "slide", "rle", "zlib" };
-    uint32_t type_values[4] = { 1, 4, 5, 7 };
-    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
-    for (uint32_t i = 0; i < 4; i++) {
-        if (type_table[i] == type) {
-            return type_values[i];
+    next_job = 0;
+    auto compress_worker = [&manifest, &compress_list]() {
+        uint32_t job_index;
+        while ((job_index = next_job++) < compress_list.size()) {
+            CompressEntry(manifest, compress_list[job_index]);
+            manifest.job_list[compress_list[job_index]].done = true;
         }
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < thread_count; i++) {
+        workers.push_back(std::thread(compress_worker));
+    }
+    compress_worker();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
     }
-    return 0;
 }
 
-int main(int argc, char **argv)
+// Recompresses the entries whose source, compress_type or alignment changed
+// since the sidecar was written. Each is written over its old data when it
+// fits there, is aligned there and nothing else shares it, or appended to
+// the archive otherwise, and the offset table is rewritten. Returns false if
+// the archive has to be packed from scratch: no usable sidecar, other
+// settings, a different entry count or a different write order.
+bool UpdateArchive(Manifest &manifest, std::vector<uint32_t> &ofs_table, uint32_t *changed_count,
+    uint32_t *moved_count)
 {
-    ParseOptions(argc, argv);
+    std::vector<EntryState> states;
+    uint32_t file_count = manifest.file_entry_list.size();
+    if (!ReadHashes(manifest, states) || states.size() != file_count) {
+        return false;
+    }
+    for (uint32_t k = 0; k < file_count; k++) {
+        if (states[manifest.write_order[k]].position != k) {
+            return false;
+        }
+    }
+    std::vector<bool> changed(file_count, false);
+    std::map<uint32_t, uint32_t> slot_users; // entries pointing at each offset
+    std::map<std::pair<uint64_t, uint64_t>, uint32_t> owner_map;
+    for (uint32_t i = 0; i < file_count; i++) {
+        FileEntry &entry = manifest.file_entry_list[i];
+        const EntryState &state = states[i];
+        // an unchanged modify time is trusted, a changed one is checked by hash
+        if (entry.comp_type == state.source_type && entry.mtime == state.mtime) {
+            entry.hash = state.hash;
+            entry.hashed = true;
+        }
+        if (!entry.hashed) {
+            InputFile input;
+            if (!input.Open(entry.path)) {
+                PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
+            }
+            HashData(input.span, &entry.hash);
+            entry.hashed = true;
+            input.Close();
+        }
+        uint32_t aligned_ofs;
+        changed[i] = entry.comp_type != state.source_type || entry.hash.fnv != state.hash.fnv
+            || entry.hash.crc != state.hash.crc || entry.hash.size != state.hash.size
+            || entry.align != state.align || entry.payload_align != state.payload_align
+            || !GetAlignedOffset(state.ofs, entry.align, entry.payload_align, &aligned_ofs)
+            || aligned_ofs != state.ofs;
+        if (changed[i]) {
+            (*changed_count)++;
+            continue;
+        }
+        CompressJob &job = manifest.job_list[i];
+        job.raw_size = state.hash.size;
+        job.comp_type = state.comp_type;
+        job.comp_size = state.size - 8;
+        job.inplace_margin = state.inplace_margin;
+        job.decode_scratch = state.decode_scratch;
+        ofs_table[i] = state.ofs;
+        slot_users[state.ofs]++;
+        owner_map.insert(std::make_pair(std::make_pair(entry.hash.fnv ^ entry.comp_type,
+            ((uint64_t)entry.hash.crc << 32) | entry.hash.size), i));
+    }
+    if (*changed_count == 0) {
+        return true;
+    }
+    // an update that fails part way leaves no sidecar, so the next one
+    // packs from scratch
+    remove(GetHashesPath(manifest).c_str());
+    std::vector<uint32_t> compress_list;
+    for (uint32_t k = 0; k < file_count; k++) {
+        uint32_t i = manifest.write_order[k];
+        FileEntry &entry = manifest.file_entry_list[i];
+        if (!changed[i]) {
+            continue;
+        }
+        auto owner = owner_map.insert(std::make_pair(std::make_pair(entry.hash.fnv ^ entry.comp_type,
+            ((uint64_t)entry.hash.crc << 32) | entry.hash.size), i)).first;
+        if (dedupe && owner->second != i && manifest.file_entry_list[owner->second].comp_type == entry.comp_type
+            && FilesEqual(manifest.file_entry_list[owner->second].path, entry.path)) {
+            entry.dup_index = owner->second;
+        } else {
+            compress_list.push_back(i);
+        }
+    }
+    CompressEntries(manifest, compress_list);
+    FILE *file = fopen(manifest.bin_path.c_str(), "r+b");
+    if (!file) {
+        PrintError("Failed to Open %s for Writing.\n", manifest.bin_path.c_str());
+    }
+    bool failed = fseek(file, 0, SEEK_END) != 0;
+    uint32_t end_ofs = ftell(file);
+    for (uint32_t k = 0; k < file_count; k++) {
+        uint32_t i = manifest.write_order[k];
+        FileEntry &entry = manifest.file_entry_list[i];
+        CompressJob &job = manifest.job_list[i];
+        if (!changed[i]) {
+            continue;
+        }
+        if (entry.dup_index != i) {
+            ofs_table[i] = ofs_table[entry.dup_index];
+            slot_users[ofs_table[i]]++;
+            continue;
+        }
+        std::vector<uint8_t> header;
+        uint32_t ofs = states[i].ofs;
+        uint32_t aligned_ofs;
+        WriteU32(header, job.raw_size);
+        WriteU32(header, job.comp_type);
+        if (slot_users[ofs] != 0 || job.data.size() + 8 > states[i].size
+            || !GetAlignedOffset(ofs, entry.align, entry.payload_align, &aligned_ofs) || aligned_ofs != ofs) {
+            GetAlignedOffset(end_ofs, entry.align, entry.payload_align, &ofs);
+            failed |= fseek(file, end_ofs, SEEK_SET) != 0;
+            WriteZeros(file, ofs - end_ofs);
+            end_ofs = ofs + job.data.size() + 8;
+            (*moved_count)++;
+        }
+        failed |= fseek(file, ofs, SEEK_SET) != 0;
+        failed |= fwrite(header.data(), 1, header.size(), file) != header.size();
+        failed |= fwrite(job.data.data(), 1, job.data.size(), file) != job.data.size();
+        std::vector<uint8_t>().swap(job.data);
+        ofs_table[i] = ofs;
+        slot_users[ofs]++;
+    }
+    std::vector<uint8_t> table;
+    for (uint32_t i = 0; i < file_count; i++) {
+        WriteU32(table, ofs_table[i]);
+    }
+    failed |= fseek(file, 4, SEEK_SET) != 0;
+    failed |= fwrite(table.data(), 1, table.size(), file) != table.size();
+    failed |= fclose(file) != 0;
+    if (failed) {
+        PrintError("Failed to Write %s.\n", manifest.bin_path.c_str());
+    }
+    return true;
+}
+
+// Rewrites an updated archive in write order, dropping the old copies of
+// entries that moved. Returns the new archive size.
+uint32_t CompactArchive(Manifest &manifest, std::vector<uint32_t> &ofs_table)
+{
+    InputFile input;
+    ArchiveWriter writer;
+    std::map<uint32_t, uint32_t> new_ofs_map;
+    uint32_t file_count = manifest.file_entry_list.size();
+    if (!input.Open(manifest.bin_path)) {
+        PrintError("Failed to Open %s for Reading.\n", manifest.bin_path.c_str());
+    }
+    if (!writer.Open(manifest.bin_path, file_count)) {
+        PrintError("Failed to Open %s for Writing.\n", writer.temp_path.c_str());
+    }
+    for (uint32_t k = 0; k < file_count; k++) {
+        uint32_t i = manifest.write_order[k];
+        FileEntry &entry = manifest.file_entry_list[i];
+        uint32_t size = manifest.job_list[entry.dup_index].comp_size + 8;
+        auto new_ofs = new_ofs_map.find(ofs_table[i]);
+        if (new_ofs != new_ofs_map.end()) {
+            ofs_table[i] = new_ofs->second;
+            continue;
+        }
+        if (ofs_table[i] > input.span.size || size > input.span.size - ofs_table[i]) {
+            PrintError("%s is not a valid archive.\n", manifest.bin_path.c_str());
+        }
+        writer.Align(entry.align, entry.payload_align);
+        new_ofs_map[ofs_table[i]] = writer.ofs;
+        writer.Write(&input.span.data[ofs_table[i]], size);
+        ofs_table[i] = new_ofs_map[ofs_table[i]];
+    }
+    uint32_t size = writer.ofs;
+    // unmapped first, as Windows cannot replace a mapped file
+    input.Close();
+    if (!writer.Close(ofs_table.data(), file_count)) {
+        PrintError("Failed to Write %s.\n", manifest.bin_path.c_str());
+    }
+    return size;
+}
+
+// Seconds spent in each stage of main, for --stats
+struct StageTimes {
+    double parse;
+    double dedupe;
+    double pack; // reading, compressing and writing every entry
+    double wait; // main thread waiting on compression workers
+    double close;
+    double verify;
+};
+
+// Prints --stats=json. Read, compress and write times are summed over
+// entries, so with -j they can exceed the pack stage.
+void WriteStats(Manifest &manifest, FILE *file, const StageTimes &times, uint32_t dup_count)
+{
+    double read_time = 0;
+    double compress_time = 0;
+    double write_time = 0;
+    uint32_t max_inplace_margin = 0;
+    uint32_t max_decode_scratch = 0;
+    for (size_t i = 0; i < manifest.job_list.size(); i++) {
+        read_time += manifest.job_list[i].read_time;
+        compress_time += manifest.job_list[i].compress_time;
+        write_time += manifest.job_list[i].write_time;
+        if (!manifest.file_entry_list[i].stream) {
+            max_inplace_margin = std::max(max_inplace_margin, manifest.job_list[i].inplace_margin);
+            max_decode_scratch = std::max(max_decode_scratch, manifest.job_list[i].decode_scratch);
+        }
+    }
+    fprintf(file, "{\n  \"stages\": {\"parse\": %.6f, \"dedupe\": %.6f, \"read\": %.6f, \"compress\": %.6f, "
+        "\"wait\": %.6f, \"write\": %.6f, \"pack\": %.6f, \"close\": %.6f, \"verify\": %.6f, \"total\": %.6f},\n",
+        times.parse, times.dedupe, read_time, compress_time, times.wait, write_time, times.pack, times.close,
+        times.verify, GetTime() / 1000000.0);
+    fprintf(file, "  \"duplicates\": %u,\n  \"cache_hits\": %u,\n  \"cache_misses\": %u,\n", dup_count,
+        cache_hits.load(), cache_misses.load());
+    fprintf(file, "  \"max_inplace_margin\": %u,\n  \"max_decode_scratch\": %u,\n  \"entries\": [\n",
+        max_inplace_margin, max_decode_scratch);
+    for (size_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        const FileEntry &entry = manifest.file_entry_list[i];
+        const CompressJob &job = manifest.job_list[entry.dup_index];
+        double ratio = job.raw_size != 0 ? (double)job.comp_size / job.raw_size : 0;
+        std::string duplicate_of = entry.dup_index != i ? std::to_string(entry.dup_index) : "null";
+        // streamed entries are never held whole, so they are not measured
+        std::string inplace_margin = !entry.stream ? std::to_string(job.inplace_margin) : "null";
+        std::string decode_scratch = !entry.stream ? std::to_string(job.decode_scratch) : "null";
+        // duplicates cost nothing beyond the entry they share
+        double wall_time = 0;
+        double bytes_per_sec = 0;
+        if (entry.dup_index == i) {
+            wall_time = job.read_time + job.compress_time + job.write_time;
+            bytes_per_sec = wall_time > 0 ? job.raw_size / wall_time : 0;
+        }
+        fprintf(file, "    {\"index\": %u, \"id\": \"%s\", \"path\": \"%s\", \"compress_type\": \"%s\", "
+            "\"raw_size\": %u, \"comp_size\": %u, \"ratio\": %.4f, \"wall_time\": %.6f, \"bytes_per_sec\": %.0f, "
+            "\"inplace_margin\": %s, \"decode_scratch\": %s, \"duplicate_of\": %s, \"streamed\": %s}%s\n",
+            (uint32_t)i, JsonEscape(entry.id).c_str(), JsonEscape(entry.path).c_str(),
+            GetCompTypeName(job.comp_type).c_str(), job.raw_size, job.comp_size, ratio, wall_time, bytes_per_sec,
+            inplace_margin.c_str(), decode_scratch.c_str(), duplicate_of.c_str(), entry.stream ? "true" : "false",
+            i + 1 < manifest.file_entry_list.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+// Turns name into a C identifier: letters upper cased and anything else
+// replaced by underscores.
+std::string MakeIdentifier(const std::string &name)
+{
+    std::string ident;
+    for (size_t i = 0; i < name.size(); i++) {
+        unsigned char c = name[i];
+        ident += isalnum(c) ? (char)toupper(c) : '_';
+    }
+    if (ident.empty() || isdigit((unsigned char)ident[0])) {
+        ident = "_" + ident;
+    }
+    return ident;
+}
+
+// FNV-1a with the seed folded into the offset basis, finished with the
+// murmur3 mix so the low bits used for table indices depend on every bit
+// of the seed and id. The generated header carries the same function.
+uint32_t HashId(uint32_t seed, const std::string &id)
+{
+    uint32_t hash = 0x811C9DC5 ^ seed;
+    for (size_t i = 0; i < id.size(); i++) {
+        hash = (hash ^ (uint8_t)id[i]) * 0x01000193;
+    }
+    hash = (hash ^ (hash >> 16)) * 0x85EBCA6B;
+    hash = (hash ^ (hash >> 13)) * 0xC2B2AE35;
+    return hash ^ (hash >> 16);
+}
+
+// Builds a minimal perfect hash of the entry ids by hash and displace.
+// Every id is put in bucket HashId(0, id) % count. A bucket holding one id
+// stores -(slot + 1) for it. A larger bucket stores the first seed that
+// sends all of its ids to free slots through HashId(seed, id) % count,
+// and slot_index maps those slots to entries.
+void BuildIdHash(Manifest &manifest, std::vector<int32_t> &bucket_seed, std::vector<uint32_t> &slot_index)
+{
+    uint32_t count = manifest.file_entry_list.size();
+    std::vector<std::vector<uint32_t>> buckets(count);
+    std::vector<bool> used(count, false);
+    bucket_seed.assign(count, 0);
+    slot_index.assign(count, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        buckets[HashId(0, manifest.file_entry_list[i].id) % count].push_back(i);
+    }
+    std::vector<uint32_t> order(count);
+    for (uint32_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+    uint32_t free_slot = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        std::vector<uint32_t> &bucket = buckets[order[i]];
+        if (bucket.size() == 1) {
+            while (used[free_slot]) {
+                free_slot++;
+            }
+            used[free_slot] = true;
+            slot_index[free_slot] = bucket[0];
+            bucket_seed[order[i]] = -(int32_t)free_slot - 1;
+        } else if (bucket.size() > 1) {
+            std::vector<uint32_t> slots;
+            for (int32_t seed = 1; slots.size() < bucket.size(); seed++) {
+                if (seed == 0x1000000) {
+                    PrintError("Failed to build the id hash table.\n");
+                }
+                slots.clear();
+                for (size_t j = 0; j < bucket.size(); j++) {
+                    uint32_t slot = HashId(seed, manifest.file_entry_list[bucket[j]].id) % count;
+                    if (used[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                        break;
+                    }
+                    slots.push_back(slot);
+                }
+                bucket_seed[order[i]] = seed;
+            }
+            for (size_t j = 0; j < bucket.size(); j++) {
+                used[slots[j]] = true;
+                slot_index[slots[j]] = bucket[j];
+            }
+        }
+    }
+}
+
+void PrintHeaderTable(std::string &text, const char *type, const std::string &name, uint32_t count,
+    const std::function<std::string(uint32_t)> &value)
+{
+    text += "static const " + std::string(type) + " " + name + "[" + std::to_string(count) + "] = {";
+    for (uint32_t i = 0; i < count; i++) {
+        text += (i % 8) == 0 ? "\n    " : " ";
+        text += value(i) + ",";
+    }
+    text += "\n};\n\n";
+}
+
+// Writes a C header naming every entry, with its sizes, compression type
+// and a perfect hash table from id to index. The file is left untouched
+// when its contents would not change, so dependent code is not rebuilt.
+void WriteHeader(Manifest &manifest)
+{
+    std::string name = manifest.header_path.substr(manifest.header_path.find_last_of("\\/") + 1);
+    std::string prefix = MakeIdentifier(name.substr(0, name.find_last_of('.')));
+    std::string lower_prefix = prefix;
+    std::transform(lower_prefix.begin(), lower_prefix.end(), lower_prefix.begin(), ::tolower);
+    std::string xml_name = manifest.xml_path.substr(manifest.xml_path.find_last_of("\\/") + 1);
+    uint32_t count = manifest.file_entry_list.size();
+    std::map<std::string, uint32_t> ident_map;
+    std::string text = "/* Generated by mpbinpack from " + xml_name + ". Do not edit. */\n\n";
+    text += "#ifndef " + MakeIdentifier(name) + "\n#define " + MakeIdentifier(name) + "\n\n";
+    text += "#include <stdint.h>\n\n";
+    text += "#define " + prefix + "_COUNT " + std::to_string(count) + "\n\n";
+    std::string ids;
+    std::string sizes;
+    uint32_t max_raw_size = 0;
+    uint32_t max_decode_scratch = 0;
+    uint32_t max_inplace_margin = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const FileEntry &entry = manifest.file_entry_list[i];
+        const CompressJob &job = manifest.job_list[entry.dup_index];
+        std::string ident = prefix + "_" + MakeIdentifier(entry.id);
+        auto inserted = ident_map.insert(std::make_pair(ident, i));
+        if (!inserted.second) {
+            PrintError("Entries %s and %s both have the header name %s.\n",
+                manifest.file_entry_list[inserted.first->second].id.c_str(), entry.id.c_str(), ident.c_str());
+        }
+        // no comma after the last enumerator, which C89 forbids
+        ids += "    " + ident + " = " + std::to_string(i) + (i + 1 < count ? ",\n" : "\n");
+        sizes += "#define " + ident + "_RAW_SIZE " + std::to_string(job.raw_size) + "\n";
+        sizes += "#define " + ident + "_COMP_SIZE " + std::to_string(job.comp_size) + "\n";
+        sizes += "#define " + ident + "_COMP_TYPE " + std::to_string(job.comp_type) + " /* "
+            + GetCompTypeName(job.comp_type) + " */\n";
+        if (header_inplace && !entry.stream) {
+            sizes += "#define " + ident + "_INPLACE_MARGIN " + std::to_string(job.inplace_margin) + "\n";
+            sizes += "#define " + ident + "_DECODE_SCRATCH " + std::to_string(job.decode_scratch) + "\n";
+            max_inplace_margin = std::max(max_inplace_margin, job.inplace_margin);
+            max_decode_scratch = std::max(max_decode_scratch, job.decode_scratch);
+        }
+        max_raw_size = std::max(max_raw_size, job.raw_size);
+    }
+    if (count != 0) {
+        text += "enum {\n" + ids + "};\n\n";
+    }
+    text += sizes + "\n";
+    text += "#define " + prefix + "_MAX_RAW_SIZE " + std::to_string(max_raw_size) + "\n";
+    if (header_inplace) {
+        text += "#define " + prefix + "_MAX_INPLACE_MARGIN " + std::to_string(max_inplace_margin) + "\n";
+        text += "#define " + prefix + "_MAX_DECODE_SCRATCH " + std::to_string(max_decode_scratch) + "\n";
+    }
+    text += "\n";
+    std::string inline_macro = prefix + "_INLINE";
+    text += "#if defined(__cplusplus) || (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L)\n";
+    text += "#define " + inline_macro + " static inline\n#else\n#define " + inline_macro + " static\n#endif\n\n";
+    text += inline_macro + " uint32_t " + lower_prefix + "_hash(uint32_t seed, const char *id)\n{\n";
+    text += "    uint32_t hash = 0x811C9DC5u ^ seed;\n";
+    text += "    while (*id) {\n        hash = (hash ^ (uint8_t)*id++) * 0x01000193u;\n    }\n";
+    text += "    hash = (hash ^ (hash >> 16)) * 0x85EBCA6Bu;\n";
+    text += "    hash = (hash ^ (hash >> 13)) * 0xC2B2AE35u;\n";
+    text += "    return hash ^ (hash >> 16);\n}\n\n";
+    if (count != 0) {
+        std::vector<int32_t> bucket_seed;
+        std::vector<uint32_t> slot_index;
+        BuildIdHash(manifest, bucket_seed, slot_index);
+        PrintHeaderTable(text, "int32_t", lower_prefix + "_hash_seed", count, [&bucket_seed](uint32_t i) {
+            return std::to_string(bucket_seed[i]);
+        });
+        PrintHeaderTable(text, "uint32_t", lower_prefix + "_hash_index", count, [&slot_index](uint32_t i) {
+            return std::to_string(slot_index[i]);
+        });
+        // lets lookups reject unknown ids, up to a hash collision, without
+        // comparing strings
+        PrintHeaderTable(text, "uint32_t", lower_prefix + "_hash_check", count, [&manifest](uint32_t i) {
+            char value[16];
+            snprintf(value, sizeof(value), "0x%08X", HashId(0, manifest.file_entry_list[i].id));
+            return std::string(value);
+        });
+    }
+    text += "/* Returns the index of the entry named id, or -1 if there is none. Only\n"
+        " * a 32-bit hash of id is checked, so an unknown id whose hash matches an\n"
+        " * entry's returns that entry. */\n";
+    text += inline_macro + " int " + lower_prefix + "_lookup(const char *id)\n{\n";
+    if (count != 0) {
+        std::string hash_size = prefix + "_COUNT";
+        text += "    uint32_t hash = " + lower_prefix + "_hash(0, id);\n";
+        text += "    int32_t seed = " + lower_prefix + "_hash_seed[hash % " + hash_size + "];\n";
+        text += "    uint32_t index = seed < 0 ? " + lower_prefix + "_hash_index[-seed - 1]\n";
+        text += "        : " + lower_prefix + "_hash_index[" + lower_prefix + "_hash((uint32_t)seed, id) % "
+            + hash_size + "];\n";
+        text += "    return " + lower_prefix + "_hash_check[index] == hash ? (int)index : -1;\n}\n\n";
+    } else {
+        text += "    (void)id;\n    return -1;\n}\n\n";
+    }
+    text += "#endif\n";
+    std::vector<uint8_t> old_text;
+    if (ReadWholeFile(manifest.header_path, old_text) && std::string(old_text.begin(), old_text.end()) == text) {
+        return;
+    }
+    std::string temp_path = GetTempPath(manifest.header_path);
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        PrintError("Failed to Open %s for Writing.\n", temp_path.c_str());
+    }
+    bool success = fwrite(text.data(), 1, text.size(), file) == text.size();
+    success = fclose(file) == 0 && success;
+    if (!success || !RenameFile(temp_path, manifest.header_path)) {
+        remove(temp_path.c_str());
+        PrintError("Failed to Write %s.\n", manifest.header_path.c_str());
+    }
+}
+
+void UnpackArchive(const std::string &archive_path, const std::string &out_dir)
+{
+    std::vector<uint8_t> archive;
+    std::vector<uint8_t> data;
+    if (!ReadWholeFile(archive_path, archive) || archive.size() < 4) {
+        PrintError("Failed to Read %s.\n", archive_path.c_str());
+    }
+    uint32_t file_count = ReadU32(&archive[0]);
+    if (file_count > (archive.size() - 4) / 4) {
+        PrintError("%s is not a valid archive.\n", archive_path.c_str());
+    }
+    MakeDirectory(out_dir);
+    std::string name = out_dir.substr(out_dir.find_last_of("\\/") + 1);
     tinyxml2::XMLDocument document;
-    PrintXmlError(document.LoadFile(xml_path.c_str()));
-    tinyxml2::XMLElement *root = document.FirstChild()->ToElement();
-    if (!root) {
-        PrintXmlError(tinyxml2::XML_ERROR_FILE_READ_ERROR);
+    tinyxml2::XMLElement *root = document.NewElement("files");
+    document.InsertEndChild(root);
+    for (uint32_t i = 0; i < file_count; i++) {
+        uint32_t comp_type;
+        std::string file_name = "file" + std::to_string(i) + ".bin";
+        if (!DecodeEntry(archive, ReadU32(&archive[4 + (i * 4)]), data, &comp_type)) {
+            PrintError("Failed to decode entry %u of %s.\n", i, archive_path.c_str());
+        }
+        FILE *file = fopen((out_dir + "/" + file_name).c_str(), "wb");
+        if (!file) {
+            PrintError("Failed to Open %s for Writing.\n", (out_dir + "/" + file_name).c_str());
+        }
+        fwrite(data.data(), 1, data.size(), file);
+        fclose(file);
+        tinyxml2::XMLElement *element = document.NewElement("file");
+        element->SetAttribute("id", ("file" + std::to_string(i)).c_str());
+        element->SetAttribute("path", file_name.c_str());
+        element->SetAttribute("compress_type", GetCompTypeName(comp_type).c_str());
+        root->InsertEndChild(element);
+    }
+    PrintXmlError(document.SaveFile((out_dir + "/" + name + ".xml").c_str()));
+}
+
+// Decodes every entry of the written archive and compares it with the
+// source it was packed from.
+void VerifyArchive(Manifest &manifest)
+{
+    std::vector<uint8_t> archive;
+    std::vector<uint8_t> data;
+    uint32_t fail_count = 0;
+    if (!ReadWholeFile(manifest.bin_path, archive)) {
+        PrintError("Failed to Read %s.\n", manifest.bin_path.c_str());
+    }
+    for (uint32_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        uint32_t comp_type;
+        FileEntry &entry = manifest.file_entry_list[i];
+        InputFile source;
+        if (!source.Open(entry.path)) {
+            PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
+        }
+        if (!DecodeEntry(archive, ReadU32(&archive[4 + (i * 4)]), data, &comp_type)
+            || comp_type != manifest.job_list[entry.dup_index].comp_type || data.size() != source.span.size
+            || (data.size() != 0 && memcmp(data.data(), source.span.data, data.size()) != 0)) {
+            fprintf(stderr, "Verify failed for %s.\n", entry.path.c_str());
+            fail_count++;
+        }
+        source.Close();
     }
-    tinyxml2::XMLElement *file_element = root->FirstChildElement("file");
-    std::string xml_dir = xml_path;
+    if (fail_count != 0) {
+        PrintError("%u entries failed verification.\n", fail_count);
+    }
+}
+
+#define BENCH_INPUT_SIZE 0x100000
+#define BENCH_MIN_TIME 0.25
+
+struct BenchInput {
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+struct BenchResult {
+    std::string input;
+    uint32_t comp_type;
+    uint32_t raw_size;
+    uint32_t comp_size;
+    double compress_mbps;
+    double decompress_mbps;
+    uint64_t peak_kb;
+    bool ok;
+};
+
+// Starts a new peak memory measurement where the platform allows it.
+// Elsewhere the peak covers the whole run so far.
+void ResetPeakMemory()
+{
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+// Returns the peak resident set size in KiB.
+uint64_t GetPeakMemory()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize / 1024;
+#else
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file) {
+        char line[256];
+        unsigned long long peak_kb = 0;
+        while (fgets(line, sizeof(line), file)) {
+            if (sscanf(line, "VmHWM: %llu", &peak_kb) == 1) {
+                break;
+            }
+        }
+        fclose(file);
+        if (peak_kb != 0) {
+            return peak_kb;
+        }
+    }
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Fixed inputs covering the best and worst cases of each format: zeros and
+// runs favour rle, tiles give slide and lzss long repeats, text is what zlib
+// is tuned for and random data defeats all of them.
+void MakeBenchInputs(std::vector<BenchInput> &inputs)
+{
+    static const char *words[] = { "the", "player", "board", "space", "coin", "star", "minigame",
+        "turn", "roll", "dice", "item", "shop", "bank", "event", "lucky", "bowser", "wins", "lost" };
+    uint32_t seed = 0x12345678;
+    auto random = [&seed]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    };
+    BenchInput input;
+    input.name = "zeros";
+    input.data.assign(BENCH_INPUT_SIZE, 0);
+    inputs.push_back(input);
+    input.name = "random";
+    for (uint32_t i = 0; i < BENCH_INPUT_SIZE; i++) {
+        input.data[i] = random();
+    }
+    inputs.push_back(input);
+    input.name = "text";
+    input.data.clear();
+    while (input.data.size() < BENCH_INPUT_SIZE) {
+        const char *word = words[random() % (sizeof(words) / sizeof(words[0]))];
+        input.data.insert(input.data.end(), word, word + strlen(word));
+        input.data.push_back((random() % 12) == 0 ? '\n' : ' ');
+    }
+    input.data.resize(BENCH_INPUT_SIZE);
+    inputs.push_back(input);
+    input.name = "tiles";
+    uint8_t tiles[16][32];
+    for (uint32_t i = 0; i < sizeof(tiles); i++) {
+        tiles[i / 32][i % 32] = random();
+    }
+    for (uint32_t i = 0; i < BENCH_INPUT_SIZE; i += 32) {
+        memcpy(&input.data[i], tiles[random() % 16], 32);
+    }
+    inputs.push_back(input);
+    input.name = "runs";
+    for (uint32_t i = 0; i < BENCH_INPUT_SIZE;) {
+        uint32_t len = std::min<uint32_t>((random() % 200) + 1, BENCH_INPUT_SIZE - i);
+        if (random() % 2) {
+            memset(&input.data[i], random(), len);
+            i += len;
+        } else {
+            for (uint32_t j = 0; j < len; j++) {
+                input.data[i++] = random();
+            }
+        }
+    }
+    inputs.push_back(input);
+}
+
+// Runs func until at least BENCH_MIN_TIME seconds have passed and returns
+// the throughput over size bytes per call in MB/s.
+double MeasureThroughput(uint32_t size, const std::function<void()> &func)
+{
+    uint32_t runs = 0;
+    double elapsed = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    do {
+        func();
+        runs++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < BENCH_MIN_TIME);
+    return ((double)size * runs) / (elapsed * 1000000.0);
+}
+
+void WriteBenchReport(FILE *file, const std::vector<BenchResult> &results)
+{
+    if (bench_format == "csv") {
+        fprintf(file, "input,format,raw_size,comp_size,ratio,compress_mbps,decompress_mbps,peak_kb,ok\n");
+    } else {
+        fprintf(file, "{\n  \"match\": \"%s\",\n  \"optimal\": %s,\n  \"kernels\": \"%s\",\n  \"results\": [\n",
+            compress_options.match_mode == MATCH_FAST ? "fast" : "compat",
+            compress_options.optimal_parse ? "true" : "false", GetKernelLevelName(GetKernelLevel()));
+    }
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &result = results[i];
+        double ratio = result.raw_size != 0 ? (double)result.comp_size / result.raw_size : 0;
+        if (bench_format == "csv") {
+            std::string input = result.input;
+            size_t quote_ofs = 0;
+            while ((quote_ofs = input.find('"', quote_ofs)) != std::string::npos) {
+                input.insert(quote_ofs, 1, '"');
+                quote_ofs += 2;
+            }
+            fprintf(file, "\"%s\",%s,%u,%u,%.4f,%.2f,%.2f,%llu,%d\n", input.c_str(),
+                GetCompTypeName(result.comp_type).c_str(), result.raw_size, result.comp_size, ratio,
+                result.compress_mbps, result.decompress_mbps, (unsigned long long)result.peak_kb, result.ok);
+        } else {
+            fprintf(file, "    {\"input\": \"%s\", \"format\": \"%s\", \"raw_size\": %u, \"comp_size\": %u, "
+                "\"ratio\": %.4f, \"compress_mbps\": %.2f, \"decompress_mbps\": %.2f, \"peak_kb\": %llu, \"ok\": %s}%s\n",
+                JsonEscape(result.input).c_str(), GetCompTypeName(result.comp_type).c_str(), result.raw_size,
+                result.comp_size, ratio, result.compress_mbps, result.decompress_mbps,
+                (unsigned long long)result.peak_kb, result.ok ? "true" : "false", i + 1 < results.size() ? "," : "");
+        }
+    }
+    if (bench_format != "csv") {
+        fprintf(file, "  ]\n}\n");
+    }
+}
+
+// Compresses and decompresses the synthetic inputs and every file in
+// corpus_dir with each format, and checks the kernels in use give the same
+// output as the scalar ones. Returns nonzero if any check failed.
+int RunBench(const std::string &corpus_dir)
+{
+    std::vector<BenchInput> inputs;
+    std::vector<BenchResult> results;
+    KernelLevel kernel_level = GetKernelLevel();
+    int status = 0;
+    MakeBenchInputs(inputs);
+    if (!corpus_dir.empty()) {
+        std::vector<std::string> names;
+        if (!ListDirectory(corpus_dir, names)) {
+            PrintError("Failed to Open %s.\n", corpus_dir.c_str());
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            BenchInput input;
+            input.name = names[i];
+            if (!ReadWholeFile(corpus_dir + "/" + names[i], input.data)) {
+                PrintError("Failed to Open %s for Reading.\n", (corpus_dir + "/" + names[i]).c_str());
+            }
+            inputs.push_back(input);
+        }
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+        ByteSpan src = { inputs[i].data.data(), (uint32_t)inputs[i].data.size() };
+        for (uint32_t j = 0; j < COMP_TYPE_COUNT; j++) {
+            BenchResult result;
+            std::vector<uint8_t> data;
+            std::vector<uint8_t> out(src.size);
+            result.input = inputs[i].name;
+            result.comp_type = comp_type_values[j];
+            result.raw_size = src.size;
+            ResetPeakMemory();
+            result.compress_mbps = MeasureThroughput(src.size, [&]() {
+                CompressBuffer(src, result.comp_type, data, compress_options);
+            });
+            result.comp_size = data.size();
+            result.ok = true;
+            result.decompress_mbps = MeasureThroughput(src.size, [&]() {
+                result.ok &= DecompressBuffer(data.data(), data.size(), result.comp_type, out.data(), src.size);
+            });
+            result.ok &= src.size == 0 || memcmp(out.data(), src.data, src.size) == 0;
+            result.peak_kb = GetPeakMemory();
+            if (!result.ok) {
+                fprintf(stderr, "Round trip failed for %s as %s.\n", result.input.c_str(),
+                    GetCompTypeName(result.comp_type).c_str());
+                status = 1;
+            }
+            if (kernel_level != KERNEL_SCALAR) {
+                std::vector<uint8_t> scalar_data;
+                SetKernelLevel(KERNEL_SCALAR);
+                CompressBuffer(src, result.comp_type, scalar_data, compress_options);
+                SetKernelLevel(kernel_level);
+                if (scalar_data != data) {
+                    fprintf(stderr, "Scalar kernels give different output for %s as %s.\n", result.input.c_str(),
+                        GetCompTypeName(result.comp_type).c_str());
+                    result.ok = false;
+                    status = 1;
+                }
+            }
+            results.push_back(result);
+        }
+    }
+    FILE *file = stdout;
+    if (!bin_path.empty()) {
+        file = fopen(bin_path.c_str(), "w");
+        if (!file) {
+            PrintError("Failed to Open %s for Writing.\n", bin_path.c_str());
+        }
+    }
+    WriteBenchReport(file, results);
+    if (file != stdout) {
+        fclose(file);
+    }
+    return status;
+}
+
+// Writes every entry in write order, waiting for each to be compressed and
+// streaming --stream-min entries itself.
+void WriteEntries(Manifest &manifest, ArchiveWriter &writer, std::vector<uint32_t> &ofs_table, StageTimes &times)
+{
+    for (uint32_t k = 0; k < manifest.write_order.size(); k++) {
+        uint32_t i = manifest.write_order[k];
+        FileEntry &entry = manifest.file_entry_list[i];
+        CompressJob &job = manifest.job_list[i];
+        if (IsCompressed(manifest, i)) {
+            TraceSpan wait_span("Wait");
+            wait_span.AddArg("path", entry.path);
+            std::unique_lock<std::mutex> lock(job_mutex);
+            job_cond.wait(lock, [&job] { return job.done; });
+            lock.unlock();
+            times.wait += wait_span.End();
+            writer.Align(entry.align, entry.payload_align);
+            TraceSpan write_span("Write entry");
+            write_span.AddArg("path", entry.path);
+            ofs_table[i] = writer.WriteEntry(job.raw_size, job.comp_type, job.data);
+            // --watch writes the archive again from the data held
+            if (!watch_mode) {
+                std::vector<uint8_t>().swap(job.data);
+            }
+            job.write_time = write_span.End();
+        } else if (entry.dup_index != i) {
+            ofs_table[i] = ofs_table[entry.dup_index];
+        } else {
+            writer.Align(entry.align, entry.payload_align);
+            ofs_table[i] = StreamEntry(manifest, i, writer);
+        }
+        std::lock_guard<std::mutex> lock(job_mutex);
+        written_count++;
+        job_cond.notify_all();
+    }
+}
+
+// Compresses every entry and writes the archive from scratch.
+void PackArchive(Manifest &manifest, std::vector<uint32_t> &ofs_table, StageTimes &times)
+{
+    TraceSpan pack_span("Pack entries");
+    ArchiveWriter writer;
+    uint32_t file_count = manifest.file_entry_list.size();
+    if (!writer.Open(manifest.bin_path, file_count)) {
+        PrintError("Failed to Open %s for Writing.\n", writer.temp_path.c_str());
+    }
+    next_read = 0;
+    next_compress = 0;
+    written_count = 0;
+    if (queue_depth == 0) {
+        queue_depth = thread_count * 4;
+    }
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < io_thread_count; i++) {
+        workers.push_back(std::thread(PrefetchWorker, std::ref(manifest)));
+    }
+    for (uint32_t i = 0; i < thread_count; i++) {
+        workers.push_back(std::thread(CompressWorker, std::ref(manifest)));
+    }
+    WriteEntries(manifest, writer, ofs_table, times);
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    times.pack = pack_span.End();
+    TraceSpan close_span("Close archive");
+    if (!writer.Close(ofs_table.data(), file_count)) {
+        PrintError("Failed to Write %s.\n", manifest.bin_path.c_str());
+    }
+    times.close = close_span.End();
+}
+
+// Escapes a path for a Makefile rule, which is also how ninja reads
+// depfiles.
+std::string EscapeMakePath(const std::string &path)
+{
+    std::string out;
+    for (size_t i = 0; i < path.size(); i++) {
+        if (path[i] == ' ' || path[i] == '#') {
+            out += '\\';
+        } else if (path[i] == '$') {
+            out += '$';
+        }
+        out += path[i];
+    }
+    return out;
+}
+
+// Writes bin_path.d, a Makefile rule making the archive depend on its
+// manifest and every source, so make or ninja only packs it again when one
+// of them changes.
+void WriteDepfile(Manifest &manifest)
+{
+    std::string path = manifest.bin_path + ".d";
+    std::vector<std::string> deps(1, manifest.xml_path);
+    std::map<std::string, bool> listed;
+    // a directory's modify time changes as files are added or removed
+    deps.insert(deps.end(), manifest.dir_paths.begin(), manifest.dir_paths.end());
+    for (size_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        const std::string &source = manifest.file_entry_list[i].path;
+        if (listed.insert(std::make_pair(source, true)).second) {
+            deps.push_back(source);
+        }
+    }
+    std::string text = EscapeMakePath(manifest.bin_path) + ":";
+    for (size_t i = 0; i < deps.size(); i++) {
+        text += " \\\n  " + EscapeMakePath(deps[i]);
+    }
+    text += "\n";
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        PrintError("Failed to Open %s for Writing.\n", path.c_str());
+    }
+    bool success = fwrite(text.data(), 1, text.size(), file) == text.size();
+    if (fclose(file) != 0 || !success) {
+        PrintError("Failed to Write %s.\n", path.c_str());
+    }
+}
+
+#define STAT_BATCH_SIZE 64
+
+// Looks up the size and modify time of each source on io_thread_count
+// threads, taking paths as they are added while the manifest is still
+// being read.
+struct SourceStatPool {
+    struct Source {
+        std::string path;
+        uint32_t size;
+        uint64_t mtime;
+        bool found;
+    };
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Source> sources; // added ones stay in place
+    size_t next_source;
+    bool finished;
+    std::vector<std::thread> threads;
+
+    void Start(uint32_t thread_count)
+    {
+        next_source = 0;
+        finished = false;
+        for (uint32_t i = 0; i < thread_count; i++) {
+            threads.push_back(std::thread(&SourceStatPool::Run, this));
+        }
+    }
+
+    void Add(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sources.push_back({ path, 0, 0, false });
+        // waking a thread for every source costs more than the lookup when
+        // the file system has it cached
+        if (sources.size() % STAT_BATCH_SIZE == 0) {
+            cond.notify_one();
+        }
+    }
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cond.wait(lock, [this] { return next_source < sources.size() || finished; });
+            if (next_source == sources.size()) {
+                return;
+            }
+            Source &source = sources[next_source++];
+            lock.unlock();
+            source.found = GetFileInfo(source.path, &source.size, &source.mtime);
+            lock.lock();
+        }
+    }
+
+    // Waits for every source added to be looked up.
+    void Finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        cond.notify_all();
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        threads.clear();
+    }
+};
+
+// Whether name matches pattern, in which * stands for any run of
+// characters and ? for any one.
+bool MatchPattern(const char *pattern, const char *name)
+{
+    const char *star = NULL;
+    const char *star_name = NULL;
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            star_name = name;
+        } else if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == 0;
+}
+
+// Reads the attributes <file> and <dir> elements share into entry.
+void ReadEntryAttributes(const XmlReader &reader, const XmlElement &element, FileEntry &entry)
+{
+    entry.comp_type = GetCompTypeValue(GetRequiredAttribute(reader, element, "compress_type"));
+    QueryOptionalAttribute(reader, element, "align", &entry.align);
+    QueryOptionalAttribute(reader, element, "payload_align", &entry.payload_align);
+    uint32_t aligned_ofs;
+    if (!GetAlignedOffset(0, entry.align, entry.payload_align, &aligned_ofs)) {
+        PrintError("%s:%u: entries cannot be aligned to %u with their data aligned to %u.\n", reader.path.c_str(),
+            element.line, entry.align, entry.payload_align);
+    }
+    QueryOptionalAttribute(reader, element, "order", &entry.order);
+    const std::string *group = element.Find("group");
+    if (group) {
+        entry.group = *group;
+    }
+}
+
+// Reads manifest.xml_path into the entry list and sets the write order.
+// The manifest is read a tag at a time, and the sources' sizes and modify
+// times are looked up on other threads as their entries are read.
+void LoadManifest(Manifest &manifest)
+{
+    XmlReader reader;
+    XmlElement element;
+    SourceStatPool stat_pool;
+    if (!reader.Open(manifest.xml_path)) {
+        PrintError("Failed to Open %s for Reading.\n", manifest.xml_path.c_str());
+    }
+    if (!reader.Next(element)) {
+        PrintError("%s\n", reader.error.empty() ? (manifest.xml_path + ": no root element").c_str()
+            : reader.error.c_str());
+    }
+    std::string xml_dir = manifest.xml_path;
     if (xml_dir.find_last_of("\\/") != std::string::npos) {
         xml_dir = xml_dir.substr(0, xml_dir.find_last_of("\\/") + 1);
     } else {
         xml_dir = "\\";
     }
-    while (file_element) {
-        FileEntry entry;
-        const char *str_temp;
-        tinyxml2::XMLError error = file_element->QueryAttribute("id", &str_temp);
-        if (error != tinyxml2::XML_SUCCESS && error != tinyxml2::XML_NO_ATTRIBUTE) {
-            PrintXmlError(error);
-        } else if(error != tinyxml2::XML_NO_ATTRIBUTE){
-            entry.id = "file"+std::to_string(file_entry_list.size());
-        } else {
-            entry.id = str_temp;
-        }
-        PrintXmlError(file_element->QueryAttribute("path", &str_temp));
-        std::string std_temp = str_temp;
-        entry.path = xml_dir+std_temp;
-        PrintXmlError(file_element->QueryAttribute("compress_type", &str_temp));
-        entry.comp_type = GetCompTypeValue(str_temp);
-        file_entry_list.push_back(entry);
-        file_element = file_element->NextSiblingElement("file");
-    }
-    FILE *bin_file = fopen(bin_path.c_str(), "wb");
-    if (!bin_file) {
-        PrintError("Failed to Open %s for Writing.\n", bin_path.c_str());
-    }
-    uint32_t file_count = file_entry_list.size();
-    uint32_t *ofs_table = new uint32_t[file_count]();
-    WriteU32(bin_file, file_count);
-    for (uint32_t i = 0; i < file_count; i++) {
-        WriteU32(bin_file, ofs_table[i]);
+    // the command line overrides the manifest's defaults, and file elements
+    // override both
+    FileEntry defaults;
+    defaults.align = 1;
+    defaults.payload_align = 1;
+    QueryOptionalAttribute(reader, element, "align", &defaults.align);
+    QueryOptionalAttribute(reader, element, "payload_align", &defaults.payload_align);
+    if (entry_align != 0) {
+        defaults.align = entry_align;
     }
-    uint32_t data_ofs = ftell(bin_file);
-    for (uint32_t i = 0; i < file_count; i++) {
-        ofs_table[i] = data_ofs;
-        FILE *data_file = fopen(file_entry_list[i].path.c_str(), "rb");
-        if (!data_file) {
-            PrintError("Failed to Open %s for Reading.\n", file_entry_list[i].path.c_str());
-        }
-        fseek(data_file, 0, SEEK_END);
-        uint32_t raw_size = ftell(data_file);
-        fseek(data_file, 0, SEEK_SET);
-        uint32_t comp_type = file_entry_list[i].comp_type;
-        WriteU32(bin_file, raw_size);
-        WriteU32(bin_file, comp_type);
-
-        size_t comp_size = raw_size;
-        switch (comp_type) {
-            case 1:
-                comp_size = CompressLzss(bin_file, data_file);
-                break;
+    if (entry_payload_align != 0) {
+        defaults.payload_align = entry_payload_align;
+    }
+    defaults.order = 0;
+    defaults.stream = false;
+    defaults.hashed = false;
+    defaults.size = 0;
+    defaults.mtime = 0;
+    stat_pool.Start(io_thread_count);
+    auto add_entry = [&manifest, &stat_pool](FileEntry &entry) {
+        entry.dup_index = manifest.file_entry_list.size();
+        manifest.file_entry_list.push_back(entry);
+        stat_pool.Add(entry.path);
+    };
+    while (reader.Next(element)) {
+        if (element.depth != 1) {
+            continue;
+        }
+        FileEntry entry = defaults;
+        if (element.name == "file") {
+            const std::string *id = element.Find("id");
+            entry.id = id ? *id : "file" + std::to_string(manifest.file_entry_list.size());
+            entry.path = xml_dir + GetRequiredAttribute(reader, element, "path");
+            ReadEntryAttributes(reader, element, entry);
+            add_entry(entry);
+        } else if (element.name == "dir") {
+            // every file directly inside path whose name matches pattern,
+            // in name order, with path/name as its id
+            std::string dir = GetRequiredAttribute(reader, element, "path");
+            while (dir.size() > 1 && (dir.back() == '/' || dir.back() == '\\')) {
+                dir.pop_back();
+            }
+            const std::string *pattern = element.Find("pattern");
+            std::vector<std::string> names;
+            ReadEntryAttributes(reader, element, entry);
+            if (!ListDirectory(xml_dir + dir, names)) {
+                PrintError("Failed to Open %s for Reading.\n", (xml_dir + dir).c_str());
+            }
+            manifest.dir_paths.push_back(xml_dir + dir);
+            for (size_t i = 0; i < names.size(); i++) {
+                if (MatchPattern(pattern ? pattern->c_str() : "*", names[i].c_str())) {
+                    entry.id = dir + "/" + names[i];
+                    entry.path = xml_dir + dir + "/" + names[i];
+                    add_entry(entry);
+                }
+            }
+        }
+    }
+    if (!reader.error.empty()) {
+        PrintError("%s\n", reader.error.c_str());
+    }
+    reader.Close();
+    stat_pool.Finish();
+    for (uint32_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        FileEntry &entry = manifest.file_entry_list[i];
+        const SourceStatPool::Source &source = stat_pool.sources[i];
+        if (!source.found) {
+            PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
+        }
+        entry.size = source.size;
+        entry.mtime = source.mtime;
+        entry.stream = stream_min != 0 && entry.comp_type != COMP_TYPE_AUTO && entry.size >= stream_min
+            && compress_options.inplace_budget == 0xFFFFFFFF && !update_mode && !watch_mode && !estimate_mode;
+    }
+    SetWriteOrder(manifest);
+    manifest.job_list.resize(manifest.file_entry_list.size());
+}
 
-            case 4:
-                comp_size = CompressSlide(bin_file, data_file, raw_size);
-                break;
+// A fixed set of threads working through a list of tasks. Each thread is
+// dealt every thread_count'th task into its own queue and takes from the
+// front of it. Once that runs dry it steals from the back of the others, so
+// one thread held up by a large task does not hold up the tasks behind it.
+struct WorkPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
 
-            case 5:
-                comp_size = CompressRle(bin_file, data_file, raw_size);
-                break;
+    // Tasks earlier in the list are started first.
+    void Start(std::vector<std::function<void()>> &tasks, uint32_t thread_count)
+    {
+        queues.clear();
+        for (uint32_t i = 0; i < thread_count; i++) {
+            queues.push_back(std::unique_ptr<Queue>(new Queue));
+        }
+        for (size_t i = 0; i < tasks.size(); i++) {
+            queues[i % thread_count]->tasks.push_back(std::move(tasks[i]));
+        }
+        tasks.clear();
+        for (uint32_t i = 0; i < thread_count; i++) {
+            threads.push_back(std::thread(&WorkPool::Run, this, i));
+        }
+    }
 
-            case 7:
-                comp_size = CompressZlib(bin_file, data_file, raw_size);
-                break;
+    bool Take(uint32_t index, std::function<void()> &task)
+    {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue &queue = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                if (i == 0) {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                } else {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Run(uint32_t index)
+    {
+        std::function<void()> task;
+        while (Take(index, task)) {
+            task();
+        }
+    }
+
+    void Join()
+    {
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        threads.clear();
+    }
+};
+
+// Output path for a manifest in batch mode: out_dir, or the manifest's own
+// directory, followed by its name with ext in place of its extension.
+std::string GetBatchPath(const std::string &manifest_path, const std::string &out_dir, const std::string &ext)
+{
+    std::string name = manifest_path;
+    if (!out_dir.empty()) {
+        name = out_dir + "/" + name.substr(name.find_last_of("\\/") + 1);
+    }
+    size_t ext_ofs = name.find_last_of('.');
+    if (ext_ofs != std::string::npos && ext_ofs > name.find_last_of("\\/") + 1) {
+        name = name.substr(0, ext_ofs);
+    }
+    return name + ext;
+}
 
-            default:
+// Packs every manifest in batch_paths. Manifests are parsed and their
+// sources sized on one shared pool of -j threads, which then compresses the
+// entries of every archive while the main thread writes each archive in turn
+// as its entries finish. As in PackArchive, no entry is started more than
+// queue_depth entries past the last one written, counting through the
+// archives in the order they are written; within that window the largest
+// entries go first, so none is left to start at the end.
+void RunBatch()
+{
+    StageTimes times = StageTimes();
+    std::vector<Manifest> manifests(batch_paths.size());
+    std::vector<std::function<void()>> tasks;
+    std::atomic<uint32_t> dup_count(0);
+    std::map<std::string, uint32_t> out_paths;
+    WorkPool pool;
+    if (update_mode || stats_mode || watch_mode || estimate_mode) {
+        PrintError("batch does not take --update, --compact, --stats, --watch or --estimate.\n");
+    }
+    // found now rather than when the first archive is written, after
+    // everything has been compressed
+    std::vector<std::string> names;
+    if (!bin_path.empty()) {
+        MakeDirectory(bin_path);
+        if (!ListDirectory(bin_path, names)) {
+            PrintError("Failed to Open %s for Writing.\n", bin_path.c_str());
+        }
+    }
+    if (!header_path.empty()) {
+        MakeDirectory(header_path);
+        if (!ListDirectory(header_path, names)) {
+            PrintError("Failed to Open %s for Writing.\n", header_path.c_str());
+        }
+    }
+    TraceSpan parse_span("Parse manifests");
+    for (size_t m = 0; m < manifests.size(); m++) {
+        Manifest &manifest = manifests[m];
+        manifest.xml_path = batch_paths[m];
+        manifest.bin_path = GetBatchPath(manifest.xml_path, bin_path, ".bin");
+        if (!header_path.empty()) {
+            manifest.header_path = GetBatchPath(manifest.xml_path, header_path, ".h");
+        }
+        auto inserted = out_paths.insert(std::make_pair(manifest.bin_path, (uint32_t)m));
+        if (!inserted.second) {
+            PrintError("%s and %s both write %s.\n", batch_paths[inserted.first->second].c_str(),
+                manifest.xml_path.c_str(), manifest.bin_path.c_str());
+        }
+        tasks.push_back([&manifest, &dup_count]() {
+            TraceSpan span("Parse manifest");
+            span.AddArg("path", manifest.xml_path);
+            LoadManifest(manifest);
+            if (dedupe) {
+                dup_count += FindDuplicates(manifest);
+            }
+            for (uint32_t i = 0; i < manifest.file_entry_list.size(); i++) {
+                manifest.job_list[i].raw_size = manifest.file_entry_list[i].size;
+            }
+        });
+    }
+    pool.Start(tasks, thread_count);
+    pool.Join();
+    times.parse = parse_span.End();
+    // every entry of every archive in the order written, which is the order
+    // written_count counts them in. Whether each is compressed by the pool
+    // is noted now, as an archive's lists are freed once it is written.
+    std::vector<std::pair<uint32_t, uint32_t>> entries;
+    std::vector<bool> compressed;
+    for (uint32_t m = 0; m < manifests.size(); m++) {
+        for (uint32_t k = 0; k < manifests[m].write_order.size(); k++) {
+            entries.push_back(std::make_pair(m, manifests[m].write_order[k]));
+            compressed.push_back(IsCompressed(manifests[m], manifests[m].write_order[k]));
+        }
+    }
+    // compressed entries that may start, largest first, then earliest
+    std::priority_queue<std::pair<uint32_t, int64_t>> ready;
+    size_t next_ready = 0;
+    written_count = 0;
+    if (queue_depth == 0) {
+        queue_depth = thread_count * 4;
+    }
+    // each task compresses whichever entry is best to start when it runs
+    auto compress_task = [&manifests, &entries, &compressed, &ready, &next_ready]() {
+        std::unique_lock<std::mutex> lock(job_mutex);
+        for (;;) {
+            while (next_ready < entries.size() && next_ready < (size_t)written_count + queue_depth) {
+                if (compressed[next_ready]) {
+                    const std::pair<uint32_t, uint32_t> &entry = entries[next_ready];
+                    ready.push(std::make_pair(manifests[entry.first].job_list[entry.second].raw_size,
+                        -(int64_t)next_ready));
+                }
+                next_ready++;
+            }
+            if (!ready.empty()) {
                 break;
+            }
+            job_cond.wait(lock);
+        }
+        const std::pair<uint32_t, uint32_t> &entry = entries[-ready.top().second];
+        ready.pop();
+        Manifest &manifest = manifests[entry.first];
+        uint32_t index = entry.second;
+        lock.unlock();
+        CompressEntry(manifest, index);
+        lock.lock();
+        manifest.job_list[index].done = true;
+        job_cond.notify_all();
+    };
+    for (size_t k = 0; k < entries.size(); k++) {
+        if (compressed[k]) {
+            tasks.push_back(compress_task);
         }
-        fclose(data_file);
-        data_ofs += comp_size + 8;
     }
-    fseek(bin_file, 4, SEEK_SET);
+    TraceSpan pack_span("Pack archives");
+    pool.Start(tasks, thread_count);
+    uint32_t entry_count = 0;
+    for (size_t m = 0; m < manifests.size(); m++) {
+        Manifest &manifest = manifests[m];
+        uint32_t file_count = manifest.file_entry_list.size();
+        std::vector<uint32_t> ofs_table(file_count);
+        ArchiveWriter writer;
+        TraceSpan span("Write archive");
+        span.AddArg("path", manifest.bin_path);
+        if (!writer.Open(manifest.bin_path, file_count)) {
+            PrintError("Failed to Open %s for Writing.\n", writer.temp_path.c_str());
+        }
+        WriteEntries(manifest, writer, ofs_table, times);
+        if (!writer.Close(ofs_table.data(), file_count)) {
+            PrintError("Failed to Write %s.\n", manifest.bin_path.c_str());
+        }
+        if (depfile) {
+            WriteDepfile(manifest);
+        }
+        if (verify) {
+            VerifyArchive(manifest);
+        }
+        if (!manifest.header_path.empty()) {
+            WriteHeader(manifest);
+        }
+        entry_count += file_count;
+        // the compressed data is gone; the rest is only needed until here
+        std::vector<FileEntry>().swap(manifest.file_entry_list);
+        std::vector<CompressJob>().swap(manifest.job_list);
+    }
+    pool.Join();
+    pack_span.End();
+    printf("Batch: %u archives, %u entries\n", (uint32_t)manifests.size(), entry_count);
+    if (dedupe) {
+        printf("Dedupe: %u duplicate entries\n", dup_count.load());
+    }
+    if (!cache_dir.empty()) {
+        printf("Cache: %u hits, %u misses\n", cache_hits.load(), cache_misses.load());
+    }
+    if (!trace_path.empty()) {
+        WriteTrace();
+    }
+}
+
+// Archive size for --estimate, with the bounds of its entries combined
+struct ArchiveEstimate {
+    uint64_t size;
+    uint64_t low;
+    uint64_t high;
+};
+
+// Lays the entries out as packing would, at their estimated sizes. Entry
+// errors are taken as independent, so the archive's bounds are the root of
+// their summed squares; an error may also move the padding after its entry
+// by up to one alignment step.
+ArchiveEstimate GetArchiveEstimate(Manifest &manifest, const std::vector<SizeEstimate> &estimates)
+{
+    uint64_t ofs = ((uint64_t)manifest.file_entry_list.size() + 1) * 4;
+    double low_squares = 0;
+    double high_squares = 0;
+    double low_error = 0; // of the last entry laid out
+    double high_error = 0;
+    for (uint32_t k = 0; k < manifest.write_order.size(); k++) {
+        uint32_t i = manifest.write_order[k];
+        const FileEntry &entry = manifest.file_entry_list[i];
+        const SizeEstimate &estimate = estimates[i];
+        if (entry.dup_index != i) {
+            continue;
+        }
+        uint32_t step = std::max(entry.align, entry.payload_align);
+        if (step > 1 && low_error + high_error > 0) {
+            low_error += step - 1;
+            high_error += step - 1;
+        }
+        low_squares += low_error * low_error;
+        high_squares += high_error * high_error;
+        uint32_t aligned_ofs;
+        if (ofs <= 0xFFFFFFFF && GetAlignedOffset((uint32_t)ofs, entry.align, entry.payload_align, &aligned_ofs)) {
+            ofs = aligned_ofs;
+        }
+        ofs += 8 + (uint64_t)estimate.size;
+        low_error = estimate.size - estimate.low;
+        high_error = estimate.high - estimate.size;
+    }
+    low_squares += low_error * low_error;
+    high_squares += high_error * high_error;
+    ArchiveEstimate total;
+    total.size = ofs;
+    total.low = ofs - std::min<uint64_t>((uint64_t)ceil(sqrt(low_squares)), ofs);
+    total.high = ofs + (uint64_t)ceil(sqrt(high_squares));
+    return total;
+}
+
+// Predicts the size of every entry and of the archive from samples, writing
+// nothing. With --budget, returns 1 if the archive is judged to go over it.
+// --refine compresses the entries with the widest bounds whole, a round of
+// -j entries at a time, until the archive's bounds fall on one side of the
+// budget.
+int RunEstimate(Manifest &manifest)
+{
+    uint32_t file_count = manifest.file_entry_list.size();
+    std::vector<SizeEstimate> estimates(file_count);
+    std::vector<std::function<void()>> tasks;
+    WorkPool pool;
+    if (dedupe) {
+        TraceSpan dedupe_span("Find duplicates");
+        FindDuplicates(manifest);
+    }
+    TraceSpan estimate_span("Estimate entries");
     for (uint32_t i = 0; i < file_count; i++) {
-        WriteU32(bin_file, ofs_table[i]);
+        if (manifest.file_entry_list[i].dup_index != i) {
+            continue;
+        }
+        tasks.push_back([&manifest, &estimates, i] {
+            FileEntry &entry = manifest.file_entry_list[i];
+            InputFile input;
+            TraceSpan span("Estimate entry");
+            span.AddArg("path", entry.path);
+            if (!input.Open(entry.path)) {
+                PrintError("Failed to Open %s for Reading.\n", entry.path.c_str());
+            }
+            manifest.job_list[i].raw_size = input.span.size;
+            EstimateCompressedSize(input.span, entry.comp_type, compress_options, &estimates[i]);
+            input.Close();
+        });
+    }
+    pool.Start(tasks, thread_count);
+    pool.Join();
+    estimate_span.End();
+    ArchiveEstimate total = GetArchiveEstimate(manifest, estimates);
+    if (budget != 0 && refine) {
+        std::vector<uint32_t> refine_order;
+        for (uint32_t i = 0; i < file_count; i++) {
+            if (manifest.file_entry_list[i].dup_index == i && !estimates[i].exact) {
+                refine_order.push_back(i);
+            }
+        }
+        std::stable_sort(refine_order.begin(), refine_order.end(), [&estimates](uint32_t a, uint32_t b) {
+            return estimates[a].high - estimates[a].low > estimates[b].high - estimates[b].low;
+        });
+        size_t next = 0;
+        while (total.low <= budget && total.high > budget && next < refine_order.size()) {
+            TraceSpan refine_span("Refine entries");
+            for (uint32_t k = 0; k < thread_count && next < refine_order.size(); k++) {
+                uint32_t i = refine_order[next++];
+                tasks.push_back([&manifest, &estimates, i] {
+                    CompressJob &job = manifest.job_list[i];
+                    CompressEntry(manifest, i);
+                    estimates[i].comp_type = job.comp_type;
+                    estimates[i].size = estimates[i].low = estimates[i].high = job.comp_size;
+                    estimates[i].exact = true;
+                    std::vector<uint8_t>().swap(job.data);
+                });
+            }
+            pool.Start(tasks, thread_count);
+            pool.Join();
+            total = GetArchiveEstimate(manifest, estimates);
+        }
+    }
+
+    printf("%-32s %-6s %10s %10s  %s\n", "Entry", "Type", "Raw size", "Estimate", "Range");
+    for (uint32_t k = 0; k < file_count; k++) {
+        uint32_t i = manifest.write_order[k];
+        const FileEntry &entry = manifest.file_entry_list[i];
+        const SizeEstimate &estimate = estimates[entry.dup_index];
+        if (entry.dup_index != i) {
+            printf("%-32s %-6s %10u %10u  same data as %s\n", entry.id.c_str(),
+                GetCompTypeName(estimate.comp_type).c_str(), manifest.job_list[entry.dup_index].raw_size, 0,
+                manifest.file_entry_list[entry.dup_index].id.c_str());
+        } else if (estimate.exact) {
+            printf("%-32s %-6s %10u %10u  exact\n", entry.id.c_str(), GetCompTypeName(estimate.comp_type).c_str(),
+                manifest.job_list[i].raw_size, estimate.size + 8);
+        } else {
+            printf("%-32s %-6s %10u %10u  %u to %u\n", entry.id.c_str(), GetCompTypeName(estimate.comp_type).c_str(),
+                manifest.job_list[i].raw_size, estimate.size + 8, estimate.low + 8, estimate.high + 8);
+        }
+    }
+    if (total.low == total.high) {
+        printf("Archive: %llu bytes, exact\n", (unsigned long long)total.size);
+    } else {
+        printf("Archive: %llu bytes, 95%% likely between %llu and %llu\n", (unsigned long long)total.size,
+            (unsigned long long)total.low, (unsigned long long)total.high);
+    }
+    if (!trace_path.empty()) {
+        WriteTrace();
+    }
+    if (budget == 0) {
+        return 0;
+    }
+    if (total.high <= budget) {
+        printf("Budget: within %u bytes, %llu to spare\n", budget, (unsigned long long)(budget - total.high));
+        return 0;
+    }
+    if (total.low > budget) {
+        printf("Budget: over %u bytes by at least %llu\n", budget, (unsigned long long)(total.low - budget));
+        return 1;
+    }
+    // only left undecided without --refine
+    printf("Budget: %u bytes is within the bounds and the estimate is %s it; pass --refine to settle it\n",
+        budget, total.size > budget ? "over" : "under");
+    return total.size > budget ? 1 : 0;
+}
+
+// Compresses the listed entries again, along with any entry that stopped
+// being a duplicate, then writes the whole archive again from the data held
+// for every entry.
+void RebuildArchive(Manifest &manifest, const std::vector<uint32_t> &changed)
+{
+    uint32_t file_count = manifest.file_entry_list.size();
+    for (size_t k = 0; k < changed.size(); k++) {
+        manifest.file_entry_list[changed[k]].hashed = false;
+        manifest.job_list[changed[k]].done = false;
+    }
+    if (dedupe) {
+        std::vector<uint32_t> old_dup_index(file_count);
+        for (uint32_t i = 0; i < file_count; i++) {
+            old_dup_index[i] = manifest.file_entry_list[i].dup_index;
+            manifest.file_entry_list[i].dup_index = i;
+        }
+        FindDuplicates(manifest);
+        for (uint32_t i = 0; i < file_count; i++) {
+            if (manifest.file_entry_list[i].dup_index != i) {
+                std::vector<uint8_t>().swap(manifest.job_list[i].data);
+            } else if (old_dup_index[i] != i) {
+                manifest.job_list[i].done = false;
+            }
+        }
+    }
+    std::vector<uint32_t> compress_list;
+    for (uint32_t k = 0; k < file_count; k++) {
+        uint32_t i = manifest.write_order[k];
+        if (IsCompressed(manifest, i) && !manifest.job_list[i].done) {
+            manifest.job_list[i].read = false;
+            compress_list.push_back(i);
+        }
+    }
+    CompressEntries(manifest, compress_list);
+    StageTimes times = StageTimes();
+    std::vector<uint32_t> ofs_table(file_count);
+    ArchiveWriter writer;
+    if (!writer.Open(manifest.bin_path, file_count)) {
+        PrintError("Failed to Open %s for Writing.\n", writer.temp_path.c_str());
+    }
+    WriteEntries(manifest, writer, ofs_table, times);
+    if (!writer.Close(ofs_table.data(), file_count)) {
+        PrintError("Failed to Write %s.\n", manifest.bin_path.c_str());
+    }
+}
+
+// Packs the archive again each time its sources change, until the process
+// is stopped. Saves arriving within --debounce ms of each other are taken
+// as one change. A source missing part way through a save is waited for.
+void WatchArchive(Manifest &manifest)
+{
+    std::vector<std::string> paths;
+    std::map<std::string, uint32_t> path_map;
+    std::vector<std::vector<uint32_t>> path_entries;
+    for (uint32_t i = 0; i < manifest.file_entry_list.size(); i++) {
+        auto inserted = path_map.insert(std::make_pair(manifest.file_entry_list[i].path, (uint32_t)paths.size()));
+        if (inserted.second) {
+            paths.push_back(manifest.file_entry_list[i].path);
+            path_entries.push_back(std::vector<uint32_t>());
+        }
+        path_entries[inserted.first->second].push_back(i);
+    }
+    FileWatcher watcher;
+    if (!watcher.Open(paths)) {
+        PrintError("Failed to watch the sources of %s.\n", manifest.xml_path.c_str());
+    }
+    printf("Watching %u sources of %s\n", (uint32_t)paths.size(), manifest.xml_path.c_str());
+    fflush(stdout);
+    std::vector<uint32_t> changed_paths;
+    while (true) {
+        watcher.Wait(0xFFFFFFFF, changed_paths);
+        while (watcher.Wait(debounce_ms, changed_paths));
+        bool missing = false;
+        for (size_t k = 0; k < changed_paths.size(); k++) {
+            if (watcher.mtimes[changed_paths[k]] == 0) {
+                printf("Waiting for %s\n", paths[changed_paths[k]].c_str());
+                missing = true;
+            }
+        }
+        if (missing) {
+            fflush(stdout);
+            continue;
+        }
+        TraceSpan rebuild_span("Rebuild archive");
+        std::vector<uint32_t> changed;
+        for (size_t k = 0; k < changed_paths.size(); k++) {
+            const std::vector<uint32_t> &entries = path_entries[changed_paths[k]];
+            changed.insert(changed.end(), entries.begin(), entries.end());
+        }
+        RebuildArchive(manifest, changed);
+        if (verify) {
+            VerifyArchive(manifest);
+        }
+        if (!manifest.header_path.empty()) {
+            WriteHeader(manifest);
+        }
+        printf("Rebuilt %s: %u entries changed in %.3f s\n", manifest.bin_path.c_str(), (uint32_t)changed.size(),
+            rebuild_span.End());
+        fflush(stdout);
+        changed_paths.clear();
+        if (!trace_path.empty()) {
+            WriteTrace();
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ParseOptions(argc, argv);
+    if (bench_mode) {
+        return RunBench(xml_path);
+    }
+    if (unpack_mode) {
+        UnpackArchive(xml_path, bin_path);
+        return 0;
+    }
+    if (batch_mode) {
+        RunBatch();
+        return 0;
+    }
+    if (watch_mode && update_mode) {
+        PrintError("--watch does not take --update or --compact.\n");
+    }
+    if (estimate_mode && (update_mode || watch_mode)) {
+        PrintError("--estimate does not take --update, --compact or --watch.\n");
+    }
+    if ((budget != 0 || refine) && !estimate_mode) {
+        PrintError("--budget and --refine need --estimate.\n");
+    }
+    StageTimes times = StageTimes();
+    TraceSpan parse_span("Parse manifest");
+    Manifest manifest;
+    manifest.xml_path = xml_path;
+    manifest.bin_path = bin_path;
+    manifest.header_path = header_path;
+    LoadManifest(manifest);
+    times.parse = parse_span.End();
+    if (estimate_mode) {
+        return RunEstimate(manifest);
+    }
+    uint32_t file_count = manifest.file_entry_list.size();
+    std::vector<uint32_t> ofs_table(file_count);
+    uint32_t dup_count = 0;
+    uint32_t changed_count = 0;
+    uint32_t moved_count = 0;
+    bool updated = false;
+    if (update_mode) {
+        TraceSpan update_span("Update archive");
+        updated = UpdateArchive(manifest, ofs_table, &changed_count, &moved_count);
+        times.pack = update_span.End();
+    }
+    if (!updated) {
+        if (dedupe) {
+            TraceSpan dedupe_span("Find duplicates");
+            dup_count = FindDuplicates(manifest);
+            times.dedupe = dedupe_span.End();
+        }
+        PackArchive(manifest, ofs_table, times);
+    }
+    uint32_t compact_size = 0;
+    if (updated && compact_mode) {
+        TraceSpan compact_span("Compact archive");
+        compact_size = CompactArchive(manifest, ofs_table);
+    }
+    if (update_mode) {
+        WriteHashes(manifest, ofs_table);
+    }
+    if (depfile) {
+        WriteDepfile(manifest);
+    }
+    if (verify) {
+        TraceSpan verify_span("Verify archive");
+        VerifyArchive(manifest);
+        times.verify = verify_span.End();
+    }
+    if (!header_path.empty()) {
+        TraceSpan header_span("Write header");
+        WriteHeader(manifest);
+    }
+    if (stats_mode) {
+        // the summaries below are part of the JSON
+        WriteStats(manifest, stdout, times, dup_count);
+    } else {
+        if (dedupe && !updated) {
+            printf("Dedupe: %u duplicate entries\n", dup_count);
+        }
+        if (!cache_dir.empty()) {
+            printf("Cache: %u hits, %u misses\n", cache_hits.load(), cache_misses.load());
+        }
+        if (updated) {
+            printf("Update: %u entries changed, %u moved to the end\n", changed_count, moved_count);
+        } else if (update_mode) {
+            printf("Update: packed from scratch\n");
+        }
+        if (compact_size != 0) {
+            printf("Compact: %u bytes\n", compact_size);
+        }
+    }
+    if (!trace_path.empty()) {
+        WriteTrace();
+    }
+    if (watch_mode) {
+        WatchArchive(manifest);
     }
-    delete[] ofs_table;
-    fclose(bin_file);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,278 @@
+#ifndef MPBINPACK_H
+#define MPBINPACK_H
+
+// In-process interface to the mpbinpack compressors and archive format.
+// Everything here works on memory buffers; the functions keep no global
+// state besides the kernel level below, so separate calls may run on
+// separate threads at once.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+// compress_type values as stored in the archive
+enum CompType {
+    COMP_TYPE_NONE = 0,
+    COMP_TYPE_LZSS = 1,
+    COMP_TYPE_SLIDE = 4,
+    COMP_TYPE_RLE = 5,
+    COMP_TYPE_ZLIB = 7,
+};
+
+#define COMP_TYPE_COUNT 5
+#define COMP_TYPE_AUTO 0xFFFFFFFF
+
+extern std::string comp_type_names[COMP_TYPE_COUNT];
+extern uint32_t comp_type_values[COMP_TYPE_COUNT];
+
+// Looks up a compress_type name from a manifest, including "auto".
+// Unknown names map to COMP_TYPE_NONE.
+uint32_t GetCompTypeValue(std::string type);
+std::string GetCompTypeName(uint32_t value);
+
+enum MatchMode {
+    MATCH_COMPAT, // reproduce the reference encoder's output bit for bit
+    MATCH_FAST, // longest match capped to the format limit, nearest on ties
+};
+
+struct CompressOptions
+{
+    MatchMode match_mode = MATCH_COMPAT;
+    bool optimal_parse = false; // parse lzss and slide for the smallest output
+    // COMP_TYPE_AUTO only tries formats no slower to decode than this:
+    // 0 none, 1 rle, 2 lzss or slide, 3 zlib
+    uint32_t max_decode_cost = 3;
+    // threads searching for matches within one entry when optimal_parse or
+    // zlib_iterations is set
+    uint32_t match_threads = 1;
+    // COMP_TYPE_AUTO skips formats needing a larger in-place decode margin
+    uint32_t inplace_budget = 0xFFFFFFFF;
+    // Writes zlib entries with the built-in deflate encoder instead of zlib,
+    // refining its parse for up to this many passes. 0 uses zlib.
+    uint32_t zlib_iterations = 0;
+};
+
+// Read-only view of input bytes
+struct ByteSpan
+{
+    const uint8_t *data;
+    uint32_t size;
+};
+
+// Instruction sets for the byte comparison kernels the encoders use. The
+// best the CPU supports is picked at startup; every level gives the same
+// output.
+enum KernelLevel {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+};
+
+KernelLevel GetKernelLevel();
+// Uses level, or the best the CPU supports if that is lower, and returns
+// the level now in use. Only call while nothing is being compressed.
+KernelLevel SetKernelLevel(KernelLevel level);
+const char *GetKernelLevelName(KernelLevel level);
+// Returns how many bytes from the start a and b have in common, up to max_len.
+uint32_t MatchPrefix(const uint8_t *a, const uint8_t *b, uint32_t max_len);
+// Returns the first i below max_len where data[i] equals data[i + 1], or
+// max_len if there is none. Reads up to data[max_len].
+uint32_t FindEqualPair(const uint8_t *data, uint32_t max_len);
+
+// Encoders append their output to a byte buffer in memory; values are
+// stored big endian.
+void WriteU8(std::vector<uint8_t> &buf, uint8_t value);
+void WriteU32(std::vector<uint8_t> &buf, uint32_t value);
+void WriteBytes(std::vector<uint8_t> &buf, const uint8_t *data, size_t len);
+void PatchU32(std::vector<uint8_t> &buf, size_t ofs, uint32_t value);
+uint32_t ReadU32(const uint8_t *data);
+
+// Compresses src as comp_type into data and returns the compressed size.
+// Unknown types store src as is.
+uint32_t CompressBuffer(ByteSpan src, uint32_t comp_type, std::vector<uint8_t> &data,
+    const CompressOptions &options = CompressOptions());
+
+typedef std::function<uint32_t(ByteSpan src, uint32_t comp_type, std::vector<uint8_t> &data)> CompressFunc;
+
+// Compresses src with every format options.max_decode_cost allows and keeps
+// the smallest in data, preferring the cheaper format to decode on a tie.
+// Returns the compressed size and stores the chosen format in comp_type.
+// Each attempt goes through compress if it is set, CompressBuffer if not.
+uint32_t CompressAuto(ByteSpan src, std::vector<uint8_t> &data, uint32_t *comp_type,
+    const CompressOptions &options = CompressOptions(), const CompressFunc &compress = CompressFunc());
+
+// A predicted compressed size, with bounds the actual size falls within
+// about 95% of the time
+struct SizeEstimate
+{
+    uint32_t comp_type; // the format chosen, for COMP_TYPE_AUTO
+    uint32_t size;
+    uint32_t low;
+    uint32_t high;
+    bool exact; // src was compressed whole and size is what it compresses to
+};
+
+// Estimates the size CompressBuffer, or CompressAuto for COMP_TYPE_AUTO,
+// would compress src to, from a few blocks spread over it. Each is
+// compressed alone and together with the block after it, and the
+// difference, the cost of a block with history behind it, is scaled up to
+// the whole input. Inputs no larger than the blocks together are
+// compressed whole. options.inplace_budget is ignored.
+void EstimateCompressedSize(ByteSpan src, uint32_t comp_type, const CompressOptions &options,
+    SizeEstimate *estimate);
+
+// Pulls up to len bytes of input into buf, returning how many it got
+typedef std::function<size_t(uint8_t *buf, size_t len)> StreamReader;
+
+// Takes the output of a streaming compressor. patch overwrites bytes
+// already written, ofs counting from the first byte of this entry.
+struct StreamSink
+{
+    std::function<void(const uint8_t *data, size_t len)> write;
+    std::function<void(uint32_t ofs, const uint8_t *data, size_t len)> patch;
+};
+
+void WriteU32(const StreamSink &sink, uint32_t value);
+// Appends to buf
+StreamSink MakeVectorSink(std::vector<uint8_t> &buf);
+StreamReader MakeFileReader(FILE *file);
+
+// Compresses size bytes from read into sink, holding only the format's
+// window and lookahead in memory: 4 KB behind for slide, a block of input
+// ahead for all of them. Slide always uses MATCH_FAST matching here and
+// optimal_parse and zlib_iterations are ignored, since these need the whole
+// input. Returns false if read runs out before size bytes.
+bool CompressStream(const StreamReader &read, uint32_t size, uint32_t comp_type, const StreamSink &sink,
+    const CompressOptions &options, uint32_t *comp_size);
+
+uint32_t GetDecodeCost(uint32_t comp_type);
+
+// Decodes raw_size bytes of comp_type data into dst. Returns false if src
+// is truncated or corrupt.
+bool DecompressBuffer(const uint8_t *src, uint32_t src_size, uint32_t comp_type, uint8_t *dst, uint32_t raw_size);
+
+// Finds how many bytes beyond raw_size a buffer needs so that src, placed
+// at its end, can be decoded into its start without the output overwriting
+// input not read yet. Assumes a decoder that reads input in stream order
+// and writes each byte only after reading what it depends on, as the
+// decoders here do. Returns false if src is truncated or corrupt.
+bool GetInPlaceMargin(ByteSpan src, uint32_t comp_type, uint32_t raw_size, uint32_t *margin);
+
+// Returns the memory a decoder for src needs besides its input and output:
+// the lzss ring buffer, or the zlib window and inflate state.
+uint32_t GetDecodeScratch(ByteSpan src, uint32_t comp_type);
+
+// Decodes the archive entry whose header is at ofs.
+bool DecodeEntry(const std::vector<uint8_t> &archive, uint32_t ofs, std::vector<uint8_t> &out, uint32_t *comp_type);
+
+bool ReadWholeFile(const std::string &path, std::vector<uint8_t> &data);
+
+// An input file mapped into memory, or read whole where mapping is not
+// possible, and handed to the encoders as a ByteSpan.
+struct InputFile
+{
+    ByteSpan span;
+    std::vector<uint8_t> buf;
+#ifdef _WIN32
+    void *file;
+    void *mapping;
+#else
+    int fd;
+#endif
+    void *view;
+
+    bool Open(const std::string &path);
+    // Reads every page of a mapping in now, so later access does not wait
+    // on the disk.
+    void Prefetch();
+    void Close();
+};
+
+bool GetFileSize(const std::string &path, uint32_t *size);
+// Gets the last write time in the platform's finest units. Values only
+// mean something compared with others from the same machine.
+bool GetModifyTime(const std::string &path, uint64_t *mtime);
+// Gets both of the above in one lookup.
+bool GetFileInfo(const std::string &path, uint32_t *size, uint64_t *mtime);
+void MakeDirectory(const std::string &path);
+// Renames from to to, replacing to if it exists.
+bool RenameFile(const std::string &from, const std::string &to);
+// Names a file beside path to write before renaming it to path, unique to
+// this process and thread so concurrent writers of path never share one.
+std::string GetTempPath(const std::string &path);
+// Appends the names of the regular files directly inside dir, sorted.
+bool ListDirectory(const std::string &dir, std::vector<std::string> &names);
+
+// Watches a set of files for changes: through inotify on Linux and by
+// polling modify times elsewhere.
+struct FileWatcher
+{
+    std::vector<std::string> paths;
+    std::vector<uint64_t> mtimes; // 0 while a file is missing
+#ifdef __linux__
+    int fd;
+    std::vector<int> path_watches; // watch on the directory of each path
+#endif
+
+    bool Open(const std::vector<std::string> &watch_paths);
+    // Waits until a file's modify time changes or timeout_ms passes,
+    // 0xFFFFFFFF waiting for ever. Appends the index of every changed path
+    // not in changed already, including paths that were removed, and
+    // returns false if nothing changed.
+    bool Wait(uint32_t timeout_ms, std::vector<uint32_t> &changed);
+    bool Check(uint32_t index, std::vector<uint32_t> &changed);
+    void Close();
+};
+
+// Finds the first offset from ofs where an entry header starts on an align
+// byte boundary and its data, 8 bytes later, on a payload_align boundary.
+// 0 and 1 both mean no alignment. Returns false if the two boundaries can
+// never both be met or the offset would pass 4 GB.
+bool GetAlignedOffset(uint32_t ofs, uint32_t align, uint32_t payload_align, uint32_t *aligned_ofs);
+
+// Writes the archive to a temporary file beside its destination in large
+// blocks, then renames it into place, so readers never see a partially
+// written archive. Space for the offset table is reserved up front and the
+// table is written once, when every entry offset is known.
+struct ArchiveWriter
+{
+    std::string path;
+    std::string temp_path;
+    FILE *file;
+    std::vector<uint8_t> buf;
+    uint32_t ofs;
+    bool failed;
+
+    bool Open(const std::string &out_path, uint32_t file_count);
+    // Appends an entry and returns its offset for the table.
+    uint32_t WriteEntry(uint32_t raw_size, uint32_t comp_type, const std::vector<uint8_t> &data);
+    void Write(const uint8_t *data, size_t len);
+    // Overwrites len bytes already written at archive offset patch_ofs.
+    void Patch(uint32_t patch_ofs, const uint8_t *data, size_t len);
+    // Pads with zeros up to the next offset GetAlignedOffset allows.
+    bool Align(uint32_t align, uint32_t payload_align);
+    void Flush();
+    bool Close(const uint32_t *ofs_table, uint32_t file_count);
+};
+
+// Builds a whole archive in memory from entries held in memory.
+struct ArchiveBuilder
+{
+    CompressOptions options;
+    std::vector<uint8_t> payload;
+    std::vector<uint32_t> ofs_table; // relative to the start of payload
+
+    // Compresses src as comp_type, which may be COMP_TYPE_AUTO, and returns
+    // the index of the new entry.
+    uint32_t Add(ByteSpan src, uint32_t comp_type);
+    // Adds an entry whose data is already compressed.
+    uint32_t AddCompressed(uint32_t raw_size, uint32_t comp_type, ByteSpan data);
+    // Adds an entry sharing the stored data of entry index.
+    uint32_t AddDuplicate(uint32_t index);
+    void Finish(std::vector<uint8_t> &archive);
+};
+
+#endif